@@ -3,3 +3,5 @@ clang++ -MMD -MF bin/ysym.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funrol
 clang++ -MMD -MF bin/ytestgen.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funroll-loops -fcolor-diagnostics -I/usr/local/include -framework Cocoa -framework OpenGL -framework IOKit -framework CoreVideo -L/usr/local/lib -lglfw3 -o bin/ytestgen apps/ytestgen.cpp
 clang++ -MMD -MF bin/ytrace.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funroll-loops -fcolor-diagnostics -I/usr/local/include -framework Cocoa -framework OpenGL -framework IOKit -framework CoreVideo -L/usr/local/lib -lglfw3 -o bin/ytrace apps/ytrace.cpp
 clang++ -MMD -MF bin/yimview.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funroll-loops -fcolor-diagnostics -I/usr/local/include -framework Cocoa -framework OpenGL -framework IOKit -framework CoreVideo -L/usr/local/lib -lglfw3 -o bin/yimview apps/yimview.cpp
+clang++ -MMD -MF bin/ymerge.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funroll-loops -fcolor-diagnostics -I/usr/local/include -framework Cocoa -framework OpenGL -framework IOKit -framework CoreVideo -L/usr/local/lib -lglfw3 -o bin/ymerge apps/ymerge.cpp
+clang++ -MMD -MF bin/ybench.d -std=c++14 -stdlib=libc++ -Ofast -ffast-math -funroll-loops -fcolor-diagnostics -I/usr/local/include -framework Cocoa -framework OpenGL -framework IOKit -framework CoreVideo -L/usr/local/lib -lglfw3 -o bin/ybench apps/ybench.cpp
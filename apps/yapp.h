@@ -43,10 +43,12 @@
 #include <GLFW/glfw3.h>
 // clang-format on
 
+#include "../yocto/yocto_bvh.h"
 #include "../yocto/yocto_cmd.h"
 #include "../yocto/yocto_gltf.h"
 #include "../yocto/yocto_obj.h"
 #include "../yocto/yocto_shape.h"
+#include "../yocto/yocto_trace.h"
 #include "../yocto/yocto_glu.h"
 
 namespace yapp {
@@ -104,8 +106,9 @@ struct material {
 //
 struct texture {
     string path;       // path
-    image<vec4f> hdr;  // if loaded, hdr data
-    image<vec4b> ldr;  // if loaded, ldr data
+    image<vec4f> hdr;   // if loaded, hdr data
+    image<vec4b> ldr;   // if loaded, ldr data
+    image<vec4h> hdrh;  // if converted, half hdr data
 };
 
 //
@@ -636,6 +639,100 @@ inline scene load_scene(const string& filename) {
     return sc;
 }
 
+//
+// Make a bvh for the scene shapes
+//
+inline ybvh::scene make_bvh(const scene& scene) {
+    auto scene_bvh = ybvh::scene();
+    auto sid = 0;
+    for (auto& shape : scene.shapes) {
+        scene_bvh.shapes.push_back({sid++,
+                                    shape.frame,
+                                    shape.points,
+                                    shape.lines,
+                                    shape.triangles,
+                                    {},
+                                    shape.pos,
+                                    shape.radius});
+    }
+    ybvh::build_bvh(scene_bvh);
+    return scene_bvh;
+}
+
+//
+// Make a trace scene that references the data of the scene, with lights,
+// textures and compiled shapes initialized. The intersection callbacks are
+// left to the caller. If half_textures is set, hdr textures are converted to
+// half floats in the scene, freeing their float copy, and ldr mip levels are
+// stored as halfs. If linear_ldr is set, ldr mip levels are stored as
+// linear floats.
+//
+inline ytrace::scene make_trace_scene(scene& scene, bool half_textures = false,
+                                      bool linear_ldr = false) {
+    auto trace_scene = ytrace::scene();
+
+    for (auto& cam : scene.cameras) {
+        trace_scene.cameras.push_back(
+            {cam.frame, cam.yfov, cam.aspect, cam.aperture, cam.focus});
+    }
+
+    for (auto& env : scene.environments) {
+        auto& mat = scene.materials[env.matid];
+        trace_scene.environments.push_back({env.frame, mat.ke, mat.ke_txt});
+    }
+
+    for (auto& shape : scene.shapes) {
+        trace_scene.shapes.push_back(
+            {shape.frame,
+             shape.matid,
+             {shape.points.size(), (vec1i*)shape.points.data()},
+             shape.lines,
+             shape.triangles,
+             shape.pos,
+             shape.norm,
+             shape.texcoord,
+             shape.color,
+             shape.radius});
+    }
+
+    for (auto& mat : scene.materials) {
+        trace_scene.materials.push_back({mat.ke, mat.kd, mat.ks, mat.rs, zero3f,
+                                         zero3f, mat.ke_txt, mat.kd_txt,
+                                         mat.ks_txt, -1, false});
+    }
+
+    for (auto& txt : scene.textures) {
+        if (!txt.hdr.empty() && half_textures) {
+            // convert to half and free the float copy
+            txt.hdrh = image<vec4h>(txt.hdr.size());
+            for (auto j = 0; j < txt.hdrh.size()[1]; j++) {
+                for (auto i = 0; i < txt.hdrh.size()[0]; i++) {
+                    txt.hdrh[{i, j}] = float_to_half(txt.hdr[{i, j}]);
+                }
+            }
+            txt.hdr = {};
+        }
+        trace_scene.textures.push_back({});
+        auto& ttxt = trace_scene.textures.back();
+        if (!txt.hdrh.empty()) {
+            ttxt.hdrh = txt.hdrh;
+        } else if (!txt.hdr.empty()) {
+            ttxt.hdr = txt.hdr;
+        } else if (!txt.ldr.empty()) {
+            ttxt.ldr = txt.ldr;
+            ttxt.linear_ldr = linear_ldr;
+            ttxt.half_mips = half_textures;
+        } else
+            assert(false);
+    }
+
+    ytrace::init_lights(trace_scene);
+    ytrace::init_textures(trace_scene);
+    ytrace::compile_scene(trace_scene);
+
+    return trace_scene;
+}
+
 //
 // Init shading
 //
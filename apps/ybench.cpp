@@ -0,0 +1,276 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "yapp.h"
+
+#include "../yocto/yocto_bvh.h"
+#include "../yocto/yocto_cmd.h"
+#include "../yocto/yocto_trace.h"
+
+#include <atomic>
+
+ytrace::intersect_point intersect_first(const ybvh::scene& scene_bvh,
+                                        const ym::ray3f& ray) {
+    auto isec = ybvh::intersect_ray(scene_bvh, ray, false);
+    return ytrace::intersect_point{
+        isec.dist, isec.sid, isec.eid, {isec.euv[0], isec.euv[1], isec.euv[2]}};
+}
+
+bool intersect_any(const ybvh::scene& scene_bvh, const ym::ray3f& ray) {
+    return (bool)ybvh::intersect_ray(scene_bvh, ray, true);
+}
+
+//
+// Ray counter of a render thread, padded to a cache line to avoid false
+// sharing between threads.
+//
+struct ray_counter {
+    uint64_t nrays = 0;
+    char pad[64 - sizeof(uint64_t)];
+};
+
+//
+// Counter of the calling thread. The intersection callbacks do not know
+// their thread id, so each render thread takes the next free slot the first
+// time it traces a ray in a given run.
+//
+uint64_t& thread_ray_counter(std::vector<ray_counter>& counters, int run,
+                             std::atomic<int>& next_slot) {
+    static thread_local auto thread_run = -1, thread_slot = 0;
+    if (thread_run != run) {
+        thread_run = run;
+        thread_slot = next_slot++;
+        assert(thread_slot < (int)counters.size());
+    }
+    return counters[thread_slot].nrays;
+}
+
+//
+// Root mean squared error and relative mean squared error of the image
+// channels with respect to the reference. The relative error is damped for
+// dark pixels as usual.
+//
+ym::vec2f compute_errors(const ym::image<ym::vec4f>& img,
+                         const ym::image<ym::vec4f>& ref) {
+    auto mse = 0.0, relmse = 0.0;
+    for (auto j = 0; j < img.size()[1]; j++) {
+        for (auto i = 0; i < img.size()[0]; i++) {
+            for (auto c = 0; c < 3; c++) {
+                auto r = (double)ref[{i, j}][c];
+                auto d = img[{i, j}][c] - r;
+                mse += d * d;
+                relmse += d * d / (r * r + 0.01);
+            }
+        }
+    }
+    auto n = 3.0 * img.size()[0] * img.size()[1];
+    return {(float)std::sqrt(mse / n), (float)(relmse / n)};
+}
+
+int main(int argc, char* argv[]) {
+    auto rtype_names = std::vector<std::pair<std::string, ytrace::rng_type>>{
+        {"uniform", ytrace::rng_type::uniform},
+        {"stratified", ytrace::rng_type::stratified},
+        {"cmjs", ytrace::rng_type::cmjs},
+        {"sobol", ytrace::rng_type::sobol}};
+    auto stype_names =
+        std::vector<std::pair<std::string, ytrace::shader_type>>{
+            {"eye", ytrace::shader_type::eyelight},
+            {"direct", ytrace::shader_type::direct},
+            {"path", ytrace::shader_type::pathtrace}};
+
+    // params
+    auto parser = ycmd::make_parser(
+        argc, argv, "measures render convergence against a reference");
+    auto ref_samples = ycmd::parse_opt<int>(
+        parser, "--reference_samples", "", "reference image samples", 4096);
+    auto samples = ycmd::parse_opt<int>(
+        parser, "--samples", "-s", "samples of each measured render", 256);
+    auto batch_samples = ycmd::parse_opt<int>(
+        parser, "--batch_samples", "", "samples between error measures", 16);
+    auto max_threads = ycmd::parse_opt<int>(
+        parser, "--threads", "-t",
+        "max number of threads, measured in powers of two [0 for default]", 0);
+    auto block_size =
+        ycmd::parse_opt<int>(parser, "--block_size", "", "block size", 32);
+    auto camera = ycmd::parse_opt<int>(parser, "--camera", "-C", "camera", 0);
+    auto aspect = ycmd::parse_opt<float>(parser, "--aspect", "-a",
+                                         "image aspect", 16.0f / 9.0f);
+    auto res = ycmd::parse_opt<int>(parser, "--resolution", "-r",
+                                    "image resolution", 180);
+    auto outfilename = ycmd::parse_opt<std::string>(
+        parser, "--output", "-o",
+        "csv filename [rays are saved to filename.rays.csv]", "bench.csv");
+    auto filenames = ycmd::parse_arga<std::string>(
+        parser, "scenes", "scene filenames, e.g. made by ytestgen", {}, -1,
+        true);
+    ycmd::check_parser(parser);
+
+    // thread counts
+    if (!max_threads) max_threads = std::thread::hardware_concurrency();
+    auto thread_counts = std::vector<int>();
+    for (auto nt = 1; nt < max_threads; nt *= 2) thread_counts.push_back(nt);
+    thread_counts.push_back(max_threads);
+
+    // output files
+    auto base = outfilename.substr(
+        0, outfilename.size() - ycmd::get_extension(outfilename).size());
+    auto raysfilename = base + ".rays.csv";
+    auto out = fopen(outfilename.c_str(), "wt");
+    auto rout = fopen(raysfilename.c_str(), "wt");
+    if (!out || !rout) {
+        printf("could not open %s or %s\n", outfilename.c_str(),
+               raysfilename.c_str());
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "scene,shader,random,threads,samples,time,rmse,relmse\n");
+    fprintf(rout, "scene,shader,depth,threads,samples,rays,time,mrays\n");
+
+    // cmjs needs a square number of samples
+    auto sqrt_samples = (int)std::round(std::sqrt(samples));
+    auto square_samples = sqrt_samples * sqrt_samples == samples;
+    if (!square_samples) printf("skipping cmjs for non-square samples\n");
+
+    // ray counting runs, never reused so that threads pick fresh counters
+    auto run = 0;
+
+    for (auto& filename : filenames) {
+        // loading scene
+        auto scene = yapp::load_scene(filename);
+        if (scene.cameras.empty()) {
+            printf("no cameras in %s\n", filename.c_str());
+            return EXIT_FAILURE;
+        }
+        scene.cameras[camera].aspect = aspect;
+        auto scene_bvh = yapp::make_bvh(scene);
+        auto trace_scene = yapp::make_trace_scene(scene);
+        auto bvh_intersect_first = [&scene_bvh](const ym::ray3f& ray) {
+            return intersect_first(scene_bvh, ray);
+        };
+        auto bvh_intersect_any = [&scene_bvh](const ym::ray3f& ray) {
+            return intersect_any(scene_bvh, ray);
+        };
+        auto size = ym::vec2i{(int)std::round(aspect * res), res};
+        auto name = ycmd::get_basename(filename);
+
+        for (auto& skv : stype_names) {
+            auto params = ytrace::render_params();
+            params.stype = skv.second;
+
+            // reference, with samples past the measured ones so that the
+            // random sequences are independent
+            printf("%s %s: rendering reference ...", name.c_str(),
+                   skv.first.c_str());
+            fflush(stdout);
+            params.rtype = ytrace::rng_type::uniform;
+            auto ref = ym::image<ym::vec4f>(size, ym::zero4f);
+            ytrace::trace_image_parallel(
+                trace_scene, camera, ref, samples + ref_samples,
+                {samples, samples + ref_samples}, params, bvh_intersect_first,
+                bvh_intersect_any, max_threads, block_size);
+
+            // error over time for each sampler and thread count
+            printf("\r%s %s: measuring convergence ...  ", name.c_str(),
+                   skv.first.c_str());
+            fflush(stdout);
+            auto img = ym::image<ym::vec4f>(size);
+            for (auto& rkv : rtype_names) {
+                if (rkv.second == ytrace::rng_type::cmjs && !square_samples)
+                    continue;
+                params.rtype = rkv.second;
+                for (auto nthreads : thread_counts) {
+                    auto buf = ytrace::make_accum_buffer(size);
+                    auto time = 0.0;
+                    for (auto s = 0; s < samples; s += batch_samples) {
+                        auto batch_timer = ym::timer();
+                        ytrace::trace_image_parallel(
+                            trace_scene, camera, buf, samples,
+                            {s, std::min(s + batch_samples, samples)}, params,
+                            bvh_intersect_first, bvh_intersect_any, nthreads,
+                            block_size);
+                        time += batch_timer.elapsed();
+                        ytrace::resolve_block(buf, img);
+                        auto err = compute_errors(img, ref);
+                        fprintf(out, "%s,%s,%s,%d,%d,%g,%g,%g\n", name.c_str(),
+                                skv.first.c_str(), rkv.first.c_str(),
+                                nthreads, buf.samples[1], time, err[0],
+                                err[1]);
+                    }
+                }
+            }
+
+            // ray throughput for increasing path lengths, counting the rays
+            // traced by the shader
+            printf("\r%s %s: measuring rays ...       ", name.c_str(),
+                   skv.first.c_str());
+            fflush(stdout);
+            params.rtype = ytrace::rng_type::def;
+            auto max_depth = (skv.second == ytrace::shader_type::pathtrace)
+                                 ? params.max_depth
+                                 : 1;
+            auto min_depth = params.min_depth;
+            for (auto depth = 1; depth <= max_depth; depth++) {
+                params.max_depth = depth;
+                params.min_depth = std::min(min_depth, depth);
+                for (auto nthreads : thread_counts) {
+                    auto counters = std::vector<ray_counter>(nthreads);
+                    std::atomic<int> next_slot(0);
+                    run++;
+                    auto count_first = [&](const ym::ray3f& ray) {
+                        thread_ray_counter(counters, run, next_slot)++;
+                        return intersect_first(scene_bvh, ray);
+                    };
+                    auto count_any = [&](const ym::ray3f& ray) {
+                        thread_ray_counter(counters, run, next_slot)++;
+                        return intersect_any(scene_bvh, ray);
+                    };
+                    auto render_timer = ym::timer();
+                    ytrace::trace_image_parallel(
+                        trace_scene, camera, img, batch_samples,
+                        {0, batch_samples}, params, count_first, count_any,
+                        nthreads, block_size);
+                    auto time = render_timer.elapsed();
+                    auto nrays = (uint64_t)0;
+                    for (auto& counter : counters) nrays += counter.nrays;
+                    fprintf(rout, "%s,%s,%d,%d,%d,%llu,%g,%g\n", name.c_str(),
+                            skv.first.c_str(), depth, nthreads, batch_samples,
+                            (unsigned long long)nrays, time,
+                            nrays / (time * 1e6));
+                }
+            }
+            printf("\r%s %s: done                 \n", name.c_str(),
+                   skv.first.c_str());
+        }
+    }
+
+    fclose(out);
+    fclose(rout);
+
+    // done
+    return EXIT_SUCCESS;
+}
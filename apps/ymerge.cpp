@@ -0,0 +1,91 @@
+//
+// LICENSE:
+//
+// Copyright (c) 2016 Fabio Pellacini
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+// this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//
+
+// general includes ------------
+#include "../yocto/yocto_cmd.h"
+#include "../yocto/yocto_math.h"
+#include "../yocto/yocto_trace.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../yocto/stb_image_write.h"
+
+int main(int argc, char* argv[]) {
+    // params
+    auto parser = ycmd::make_parser(
+        argc, argv, "merges partial renders saved by ytrace in sample order");
+    auto exposure =
+        ycmd::parse_opt<float>(parser, "--exposure", "-e", "image exposure", 0);
+    auto gamma =
+        ycmd::parse_opt<float>(parser, "--gamma", "-g", "image gamma", 2.2);
+    auto imfilename = ycmd::parse_opt<std::string>(
+        parser, "--output", "-o", "image filename [ytab for partial renders]",
+        "out.hdr");
+    auto filenames = ycmd::parse_arga<std::string>(
+        parser, "partials", "partial renders in sample order", {}, -1, true);
+    ycmd::check_parser(parser);
+
+    // merge partials one at a time
+    auto buf = ytrace::accum_buffer();
+    auto errmsg = std::string();
+    for (auto& filename : filenames) {
+        auto partial = ytrace::accum_buffer();
+        if (!ytrace::load_accum_buffer(filename, partial, errmsg) ||
+            !ytrace::merge_accum_buffers(buf, partial, errmsg)) {
+            printf("%s: %s\n", filename.c_str(), errmsg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    printf("merged samples %d to %d\n", buf.samples[0], buf.samples[1]);
+
+    // save
+    auto ext = ycmd::get_extension(imfilename);
+    if (ext == ".ytab") {
+        if (!ytrace::save_accum_buffer(imfilename, buf, errmsg)) {
+            printf("%s: %s\n", imfilename.c_str(), errmsg.c_str());
+            return EXIT_FAILURE;
+        }
+    } else {
+        auto hdr = ym::image<ym::vec4f>(buf.sum.size());
+        ytrace::resolve_block(buf, hdr);
+        if (ext == ".hdr") {
+            stbi_write_hdr(imfilename.c_str(), hdr.size()[0], hdr.size()[1], 4,
+                           (float*)hdr.data());
+        } else if (ext == ".png") {
+            auto ldr = ym::image<ym::vec4b>(hdr.size());
+            ym::exposure_gamma(hdr, ldr, exposure, gamma);
+            stbi_write_png(imfilename.c_str(), ldr.size()[0], ldr.size()[1], 4,
+                           ldr.data(), ldr.size()[0] * 4);
+        } else {
+            printf("supports only hdr, png and ytab for writing\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // done
+    return EXIT_SUCCESS;
+}
@@ -48,11 +48,24 @@ ym::image<ym::vec4b> ldr;
 ybvh::scene scene_bvh;
 ytrace::scene trace_scene;
 
+// alpha-cutout texture of each shape (empty if all shapes are opaque)
+std::vector<const ym::image<ym::vec4b>*> cutouts;
+
 // rendering parameters
 int samples = 256;
 ytrace::render_params params;
 int block_size = 32;
 int nthreads = 0;
+bool linear_ldr = false;
+bool half_textures = false;
+bool aovs = false;
+bool denoise = false;
+bool stream = false;
+std::string checkpoint;
+ym::vec2i sample_range = {0, -1};
+ytrace::denoise_params denoise_params;
+bool guiding = false;
+ytrace::path_guide guide;
 
 // lighting
 float hdr_exposure = 0;
@@ -61,6 +74,9 @@ bool camera_lights = false;
 
 // camera
 int camera = 0;
+bool all_cameras = false;
+int frames = 1;
+float turntable = 360;
 float aspect = 16.0f / 9.0f;
 int res = 720;
 
@@ -69,9 +85,10 @@ bool no_ui = false;
 bool legacy_gl = false;
 
 // progressive rendering
-ym::image<ym::vec4f> preview;
-int cur_sample = 0, cur_block = 0;
+std::vector<int> preview_scales;
+int cur_preview = 0, cur_sample = 0, cur_block = 0;
 int blocks_per_update = 8;
+ym::vec2i roi_xy = {0, 0}, roi_wh = {-1, -1};
 
 // view variables
 int cur_background = 0;
@@ -99,13 +116,23 @@ GLFWwindow* window = nullptr;
 nk_context* nuklear_ctx = nullptr;
 int hud_width = 256;
 
-std::vector<std::pair<ym::vec2i, ym::vec2i>> make_image_blocks(int w, int h,
-                                                               int bs) {
+// clips the region of interest to the image
+void clip_roi(const ym::vec2i& size, ym::vec2i& xy, ym::vec2i& wh) {
+    xy = {ym::clamp(xy[0], 0, size[0]), ym::clamp(xy[1], 0, size[1])};
+    wh = {(wh[0] < 0) ? size[0] - xy[0] : ym::min(wh[0], size[0] - xy[0]),
+          (wh[1] < 0) ? size[1] - xy[1] : ym::min(wh[1], size[1] - xy[1])};
+}
+
+// blocks covering the region of interest xy, wh, clipped to the image
+std::vector<std::pair<ym::vec2i, ym::vec2i>> make_image_blocks(
+    int w, int h, int bs, ym::vec2i xy = {0, 0}, ym::vec2i wh = {-1, -1}) {
+    clip_roi({w, h}, xy, wh);
     std::vector<std::pair<ym::vec2i, ym::vec2i>> blocks;
-    for (int j = 0; j < h; j += bs) {
-        for (int i = 0; i < w; i += bs) {
-            blocks.push_back(
-                {{i, j}, {ym::min(bs, w - i), ym::min(bs, h - j)}});
+    for (int j = xy[1]; j < xy[1] + wh[1]; j += bs) {
+        for (int i = xy[0]; i < xy[0] + wh[0]; i += bs) {
+            blocks.push_back({{i, j},
+                              {ym::min(bs, xy[0] + wh[0] - i),
+                               ym::min(bs, xy[1] + wh[1] - j)}});
         }
     }
     return blocks;
@@ -127,84 +154,76 @@ void save_image(const std::string& filename,
     }
 }
 
-ybvh::scene make_bvh(const yapp::scene& scene) {
-    auto scene_bvh = ybvh::scene();
-    auto sid = 0;
-    for (auto& shape : scene.shapes) {
-        scene_bvh.shapes.push_back({sid++,
-                                    shape.frame,
-                                    shape.points,
-                                    shape.lines,
-                                    shape.triangles,
-                                    {},
-                                    shape.pos,
-                                    shape.radius});
-    }
-    ybvh::build_bvh(scene_bvh);
-    return scene_bvh;
+// triangle shapes whose diffuse texture has transparent texels are cut out
+// where the alpha is below one half
+std::vector<const ym::image<ym::vec4b>*> make_cutouts(
+    const yapp::scene& scene) {
+    auto has_alpha = std::vector<bool>(scene.textures.size(), false);
+    for (auto tid = 0; tid < scene.textures.size(); tid++) {
+        auto& ldr = scene.textures[tid].ldr;
+        for (auto j = 0; j < ldr.size()[1] && !has_alpha[tid]; j++) {
+            for (auto i = 0; i < ldr.size()[0] && !has_alpha[tid]; i++) {
+                if (ldr[{i, j}][3] < 255) has_alpha[tid] = true;
+            }
+        }
+    }
+    auto cutouts =
+        std::vector<const ym::image<ym::vec4b>*>(scene.shapes.size(), nullptr);
+    auto found = false;
+    for (auto sid = 0; sid < scene.shapes.size(); sid++) {
+        auto& shape = scene.shapes[sid];
+        if (shape.matid < 0 || shape.triangles.empty() ||
+            shape.texcoord.empty())
+            continue;
+        auto tid = scene.materials[shape.matid].kd_txt;
+        if (tid < 0 || !has_alpha[tid]) continue;
+        cutouts[sid] = &scene.textures[tid].ldr;
+        found = true;
+    }
+    if (!found) cutouts.clear();
+    return cutouts;
+}
+
+// any-hit filter that skips the transparent texels of cutout shapes, as a
+// lambda so that it is inlined in the bvh leaf loop
+auto cutout_filter = [](const ybvh::point& isec) {
+    auto txt = cutouts[isec.sid];
+    if (!txt) return true;
+    auto& shape = scene.shapes[isec.sid];
+    auto& t = shape.triangles[isec.eid];
+    auto uv = shape.texcoord[t[0]] * isec.euv[0] +
+              shape.texcoord[t[1]] * isec.euv[1] +
+              shape.texcoord[t[2]] * isec.euv[2];
+    auto size = txt->size();
+    auto i = (int)std::floor(uv[0] * size[0]) % size[0];
+    auto j = (int)std::floor(uv[1] * size[1]) % size[1];
+    if (i < 0) i += size[0];
+    if (j < 0) j += size[1];
+    return (*txt)[{i, j}][3] >= 128;
+};
+
+ytrace::intersect_point intersect_first(const ybvh::scene& scene_bvh,
+                                        const ym::ray3f& ray) {
+    auto isec = (cutouts.empty())
+                    ? ybvh::intersect_ray(scene_bvh, ray, false)
+                    : ybvh::intersect_ray(scene_bvh, ray, false, cutout_filter);
+    return ytrace::intersect_point{
+        isec.dist, isec.sid, isec.eid, {isec.euv[0], isec.euv[1], isec.euv[2]}};
 }
 
-ytrace::scene make_trace_scene(yapp::scene& scene, ybvh::scene& scene_bvh,
-                               int camera) {
-    auto trace_scene = ytrace::scene();
-
-    trace_scene.intersect_first = [&scene_bvh](const ym::ray3f& ray) {
-        auto isec = ybvh::intersect_ray(scene_bvh, ray, false);
-        return ytrace::intersect_point{isec.dist,
-                                       isec.sid,
-                                       isec.eid,
-                                       {isec.euv[0], isec.euv[1], isec.euv[2]}};
-    };
-    trace_scene.intersect_any = [&scene_bvh](const ym::ray3f& ray) {
-        return ybvh::intersect_ray(scene_bvh, ray, false);
-    };
-
-    for (auto& cam : scene.cameras) {
-        trace_scene.cameras.push_back(
-            {cam.frame, cam.yfov, cam.aspect, cam.aperture, cam.focus});
-    }
-
-    for (auto& env : scene.environments) {
-        auto& mat = scene.materials[env.matid];
-        trace_scene.environments.push_back({env.frame, mat.ke, mat.ke_txt});
-    }
-
-    for (auto& shape : scene.shapes) {
-        trace_scene.shapes.push_back(
-            {shape.frame,
-             shape.matid,
-             {shape.points.size(), (ym::vec1i*)shape.points.data()},
-             shape.lines,
-             shape.triangles,
-             shape.pos,
-             shape.norm,
-             shape.texcoord,
-             shape.color,
-             shape.radius});
-    }
-
-    for (auto& mat : scene.materials) {
-        trace_scene.materials.push_back({mat.ke, mat.kd, mat.ks, mat.rs,
-                                         ym::zero3f, ym::zero3f, mat.ke_txt,
-                                         mat.kd_txt, mat.ks_txt, -1, false});
-    }
-
-    for (auto& txt : scene.textures) {
-        if (!txt.hdr.empty()) {
-            trace_scene.textures.push_back(
-                {ym::image_view<ym::vec4f>(txt.hdr), {}});
-        } else if (!txt.ldr.empty()) {
-            trace_scene.textures.push_back(
-                {{}, ym::image_view<ym::vec4b>{txt.ldr}});
-        } else
-            assert(false);
-    }
-
-    ytrace::init_lights(trace_scene);
-
-    return trace_scene;
+bool intersect_any(const ybvh::scene& scene_bvh, const ym::ray3f& ray) {
+    if (cutouts.empty()) return (bool)ybvh::intersect_ray(scene_bvh, ray, true);
+    return (bool)ybvh::intersect_ray(scene_bvh, ray, true, cutout_filter);
 }
 
+// intersection routines bound at compile time for trace_block
+auto bvh_intersect_first = [](const ym::ray3f& ray) {
+    return intersect_first(scene_bvh, ray);
+};
+auto bvh_intersect_any = [](const ym::ray3f& ray) {
+    return intersect_any(scene_bvh, ray);
+};
+
 void text_callback(GLFWwindow* window, unsigned int key) {
     nk_glfw3_gl3_char_callback(window, key);
     if (nk_item_is_any_active(nuklear_ctx)) return;
@@ -300,21 +319,19 @@ bool update() {
         auto& trace_cam = trace_scene.cameras[camera];
         trace_cam = {cam.frame, cam.yfov, cam.aspect, cam.aperture, cam.focus};
 
-        // render preview
-        preview.resize(hdr.size() / block_size);
-        ytrace::trace_image(trace_scene, camera, preview, 1, params);
-        for (auto qj = 0; qj < preview.size()[1]; qj++) {
-            for (auto qi = 0; qi < preview.size()[0]; qi++) {
-                for (auto j = qj * block_size;
-                     j < ym::min((qj + 1) * block_size, hdr.size()[1]); j++) {
-                    for (auto i = qi * block_size;
-                         i < ym::min((qi + 1) * block_size, hdr.size()[0]);
-                         i++) {
-                        hdr[{i, j}] = preview[{qi, qj}];
-                    }
-                }
-            }
-        }
+        // reset current counters
+        cur_preview = 0;
+        cur_sample = 0;
+        cur_block = 0;
+        scene_updated = false;
+    }
+
+    if (cur_preview < preview_scales.size()) {
+        // render the next preview over the whole image, coarse to fine
+        auto scale = preview_scales[cur_preview++];
+        ytrace::trace_preview(trace_scene, camera, hdr, samples, scale, params,
+                              bvh_intersect_first, bvh_intersect_any, {0, 0},
+                              {-1, -1}, nthreads, block_size);
         ym::exposure_gamma(hdr, ldr, hdr_exposure, hdr_gamma);
         if (legacy_gl) {
             yglu::legacy::update_texture(texture_id, hdr.size()[0],
@@ -325,11 +342,6 @@ bool update() {
                                          hdr.size()[1], 4,
                                          (unsigned char*)ldr.data(), false);
         }
-
-        // reset current counters
-        cur_sample = 0;
-        cur_block = 0;
-        scene_updated = false;
     } else {
         if (cur_sample == samples) return false;
         futures.clear();
@@ -339,7 +351,9 @@ bool update() {
             futures.push_back(pool->enqueue([block]() {
                 ytrace::trace_block(trace_scene, camera, hdr, samples,
                                     block.first, block.second,
-                                    {cur_sample, cur_sample + 1}, params, true);
+                                    {cur_sample, cur_sample + 1}, params,
+                                    bvh_intersect_first, bvh_intersect_any,
+                                    true);
                 ym::exposure_gamma(hdr, ldr, hdr_exposure, hdr_gamma,
                                    block.first, block.second);
             }));
@@ -416,8 +430,6 @@ void run_ui() {
             // updated images
             hdr.resize(window_size);
             ldr.resize(window_size);
-            preview.resize(
-                {window_size[0] / block_size, window_size[1] / block_size});
 
             // update texture
             if (legacy_gl) {
@@ -433,8 +445,8 @@ void run_ui() {
             }
 
             // updated blocks
-            blocks =
-                make_image_blocks(hdr.size()[0], hdr.size()[1], block_size);
+            blocks = make_image_blocks(hdr.size()[0], hdr.size()[1],
+                                       block_size, roi_xy, roi_wh);
             scene_updated = true;
         }
 
@@ -485,36 +497,228 @@ void run_ui() {
     yui::clear_glfw(window);
 }
 
+void save_aovs(const ytrace::accum_buffer& buf) {
+    auto base = imfilename.substr(
+        0, imfilename.size() - ycmd::get_extension(imfilename).size());
+    auto aov_names = std::vector<std::pair<std::string, ytrace::aov_type>>{
+        {"albedo", ytrace::aov_type::albedo},
+        {"normal", ytrace::aov_type::normal},
+        {"depth", ytrace::aov_type::depth},
+        {"variance", ytrace::aov_type::variance}};
+    auto aov = ym::image<ym::vec4f>(hdr.size());
+    for (auto& kv : aov_names) {
+        ytrace::resolve_aov(buf, kv.second, aov);
+        auto aovfilename = base + "." + kv.first + ".hdr";
+        if (!stbi_write_hdr(aovfilename.c_str(), aov.size()[0],
+                            aov.size()[1], 4, (float*)aov.data()))
+            printf("could not write %s\n", aovfilename.c_str());
+    }
+}
+
+void render_streamed() {
+    // the radiance format stores uncompressed rows top to bottom, so each
+    // strip is written as soon as it is done
+    auto size = ym::vec2i{(int)std::round(aspect * res), res};
+    auto f = fopen(imfilename.c_str(), "wb");
+    if (!f) {
+        printf("could not open %s\n", imfilename.c_str());
+        exit(1);
+    }
+    if (fprintf(f, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+                size[1], size[0]) < 0) {
+        printf("could not write %s\n", imfilename.c_str());
+        exit(1);
+    }
+    auto strip = ym::image<ym::vec4f>({size[0], block_size});
+    auto rgbe = std::vector<ym::vec4b>(size[0]);
+    for (auto row = 0; row < size[1]; row += block_size) {
+        printf("\rrendering rows %d to %d of %d ...", row,
+               ym::min(row + block_size, size[1]), size[1]);
+        fflush(stdout);
+        strip.resize({size[0], ym::min(block_size, size[1] - row)});
+        ytrace::trace_strip_parallel(trace_scene, camera, size, row, strip,
+                                     samples, {0, samples}, params,
+                                     bvh_intersect_first, bvh_intersect_any,
+                                     nthreads, block_size);
+        for (auto j = 0; j < strip.size()[1]; j++) {
+            for (auto i = 0; i < size[0]; i++) {
+                auto& c = strip[{i, j}];
+                auto v = ym::max(c[0], ym::max(c[1], c[2]));
+                if (v < 1e-32f) {
+                    rgbe[i] = {0, 0, 0, 0};
+                } else {
+                    auto e = 0;
+                    auto m = std::frexp(v, &e) * 256 / v;
+                    rgbe[i] = {(unsigned char)(c[0] * m),
+                               (unsigned char)(c[1] * m),
+                               (unsigned char)(c[2] * m),
+                               (unsigned char)(e + 128)};
+                }
+            }
+            if (fwrite(rgbe.data(), 4, size[0], f) != (size_t)size[0]) {
+                printf("\ncould not write %s\n", imfilename.c_str());
+                exit(1);
+            }
+        }
+    }
+    if (fclose(f)) {
+        printf("\ncould not write %s\n", imfilename.c_str());
+        exit(1);
+    }
+    printf("\rrendering done                          \n");
+}
+
 void render_offline() {
     printf("tracing %s to %s\n", filename.c_str(), imfilename.c_str());
-    printf("rendering ...");
+    if (stream) {
+        render_streamed();
+        return;
+    }
+    auto partial = ycmd::get_extension(imfilename) == ".ytab";
+    auto range = ym::vec2i{sample_range[0],
+                           (sample_range[1] < 0) ? samples : sample_range[1]};
+    printf("rendering samples %d to %d ...", range[0], range[1]);
     fflush(stdout);
-    for (auto cur_sample = 0; cur_sample < samples; cur_sample++) {
-        printf("\rrendering sample %d/%d", cur_sample + 1, samples);
-        fflush(stdout);
-        futures.clear();
-        for (auto cur_block = 0; cur_block < blocks.size(); cur_block++) {
-            auto block = blocks[cur_block];
-            futures.push_back(pool->enqueue([=, &block]() {
-                ytrace::trace_block(trace_scene, camera, hdr, samples,
-                                    block.first, block.second,
-                                    {cur_sample, cur_sample + 1}, params, true);
-            }));
+    if (params.adaptive || aovs || denoise || !checkpoint.empty() ||
+        partial || range != ym::vec2i{0, samples} || params.time_budget > 0 ||
+        params.target_error > 0 || guiding) {
+        // length of the random sequences, which progressive rendering sets
+        // to the last sample it may render
+        auto progressive =
+            guiding || params.time_budget > 0 || params.target_error > 0 ||
+            (params.adaptive && params.adaptive_max_samples > 0);
+        auto ns = samples;
+        if (progressive)
+            ns = std::max(range[1],
+                          (params.adaptive) ? params.adaptive_max_samples : 0);
+        auto buf = ytrace::make_accum_buffer(hdr.size(), aovs || denoise);
+        auto errmsg = std::string();
+        if (!checkpoint.empty() &&
+            ytrace::load_accum_buffer(checkpoint, buf, errmsg)) {
+            if (buf.sum.size() != hdr.size() ||
+                buf.ids.empty() == (aovs || denoise) || buf.ns != ns ||
+                buf.rtype != params.rtype || buf.stype != params.stype) {
+                printf("\ncheckpoint %s does not match the render\n",
+                       checkpoint.c_str());
+                exit(1);
+            }
+            printf("\rresuming from sample %d ...", buf.samples[1]);
+            fflush(stdout);
         }
-        for (auto& future : futures) future.wait();
+        if (buf.samples[0] == buf.samples[1])
+            buf.samples = {range[0], range[0]};
+        auto render_timer = ym::timer();
+        if (guiding) {
+            ytrace::init_guiding(trace_scene, guide);
+            ytrace::trace_image_progressive(trace_scene, camera, buf, range[1],
+                                            params, guide, bvh_intersect_first,
+                                            bvh_intersect_any, nthreads,
+                                            block_size);
+        } else if (progressive) {
+            ytrace::trace_image_progressive(trace_scene, camera, buf, range[1],
+                                            params, bvh_intersect_first,
+                                            bvh_intersect_any, nthreads,
+                                            block_size);
+            if (!checkpoint.empty() &&
+                !ytrace::save_accum_buffer(checkpoint, buf, errmsg)) {
+                printf("\n%s\n", errmsg.c_str());
+                exit(1);
+            }
+        } else {
+            auto batch = params.batch_samples;
+            for (auto s = buf.samples[1]; s < range[1]; s += batch) {
+                ytrace::trace_image_parallel(
+                    trace_scene, camera, buf, ns,
+                    {s, std::min(s + batch, range[1])}, params,
+                    bvh_intersect_first, bvh_intersect_any, nthreads,
+                    block_size);
+                if (!checkpoint.empty() &&
+                    !ytrace::save_accum_buffer(checkpoint, buf, errmsg)) {
+                    printf("\n%s\n", errmsg.c_str());
+                    exit(1);
+                }
+            }
+        }
+        auto render_time = render_timer.elapsed();
+        if (partial) {
+            if (!ytrace::save_accum_buffer(imfilename, buf, errmsg)) {
+                printf("\n%s\n", errmsg.c_str());
+                exit(1);
+            }
+            printf("\rrendering done\n");
+            return;
+        }
+        ytrace::resolve_block(buf, hdr);
+        auto total = 0.0;
+        for (auto c : ym::image_view<int>(buf.count)) total += c;
+        printf("\rrendering done [%d samples, %.1f per pixel, %.1fs]\n",
+               buf.samples[1], total / (hdr.size()[0] * hdr.size()[1]),
+               render_time);
+        if (aovs) save_aovs(buf);
+        if (denoise) {
+            printf("denoising ...");
+            fflush(stdout);
+            ytrace::denoise_image(hdr, buf, denoise_params, nthreads);
+            printf("\rdenoising done\n");
+        }
+    } else {
+        ytrace::trace_image_parallel(trace_scene, camera, hdr, samples,
+                                     {0, samples}, params, bvh_intersect_first,
+                                     bvh_intersect_any, nthreads, block_size);
+        printf("\rrendering done\n");
     }
-    printf("\rrendering done\n");
     fflush(stdout);
     ym::exposure_gamma(hdr, ldr, hdr_exposure, hdr_gamma);
     save_image(imfilename, hdr, ldr);
 }
 
+std::string shot_filename(const std::string& filename, int cid, int frame) {
+    auto ext = ycmd::get_extension(filename);
+    auto name = filename.substr(0, filename.size() - ext.size());
+    if (all_cameras) name += ".c" + std::to_string(cid);
+    if (frames > 1) {
+        char buf[16];
+        sprintf(buf, ".f%04d", frame);
+        name += buf;
+    }
+    return name + ext;
+}
+
+void render_shots() {
+    // render each camera and frame sharing the bvh, lights and textures;
+    // only the camera changes between shots
+    auto cameras = std::vector<int>();
+    if (all_cameras) {
+        for (auto cid = 0; cid < scene.cameras.size(); cid++)
+            cameras.push_back(cid);
+    } else {
+        cameras.push_back(camera);
+    }
+    auto base_imfilename = imfilename, base_checkpoint = checkpoint;
+    for (auto cid : cameras) {
+        for (auto frame = 0; frame < frames; frame++) {
+            auto cam = scene.cameras[cid];
+            auto angle = (float)(ym::pi * turntable / 180) * frame / frames;
+            ym::turntable(cam.frame, cam.focus, ym::vec2f{angle, 0}, 0.0f,
+                          ym::zero2f);
+            trace_scene.cameras[cid] = {cam.frame, cam.yfov, cam.aspect,
+                                        cam.aperture, cam.focus};
+            camera = cid;
+            imfilename = shot_filename(base_imfilename, cid, frame);
+            if (!base_checkpoint.empty())
+                checkpoint = shot_filename(base_checkpoint, cid, frame);
+            render_offline();
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
     auto rtype_names = std::unordered_map<std::string, ytrace::rng_type>{
         {"default", ytrace::rng_type::def},
         {"uniform", ytrace::rng_type::uniform},
         {"stratified", ytrace::rng_type::stratified},
-        {"cmjs", ytrace::rng_type::cmjs}};
+        {"cmjs", ytrace::rng_type::cmjs},
+        {"sobol", ytrace::rng_type::sobol}};
     auto stype_names = std::unordered_map<std::string, ytrace::shader_type>{
         {"default", ytrace::shader_type::def},
         {"eye", ytrace::shader_type::eyelight},
@@ -536,6 +740,14 @@ int main(int argc, char* argv[]) {
     camera_lights = ycmd::parse_flag(parser, "--camera_lights", "-c",
                                      "enable camera lights", false);
     camera = ycmd::parse_opt<int>(parser, "--camera", "-C", "camera", 0);
+    all_cameras = ycmd::parse_flag(parser, "--all_cameras", "",
+                                   "renders all cameras [offline only]", false);
+    frames = ycmd::parse_opt<int>(
+        parser, "--frames", "",
+        "turntable frames rendered for each camera [offline only]", 1);
+    turntable = ycmd::parse_opt<float>(
+        parser, "--turntable", "",
+        "turntable rotation over all frames in degrees", 360);
     no_ui = ycmd::parse_flag(parser, "--no-ui", "", "runs offline", false);
     legacy_gl = ycmd::parse_flag(parser, "--legacy_opengl", "-L",
                                  "uses legacy OpenGL", false);
@@ -543,17 +755,106 @@ int main(int argc, char* argv[]) {
                                     "number of threads [0 for default]", 0);
     block_size =
         ycmd::parse_opt<int>(parser, "--block_size", "", "block size", 32);
+    params.adaptive_error = ycmd::parse_opt<float>(
+        parser, "--adaptive_error", "",
+        "adaptive sampling relative error [0 to disable]", 0);
+    params.adaptive = params.adaptive_error > 0;
+    params.adaptive_max_samples = ycmd::parse_opt<int>(
+        parser, "--adaptive_max_samples", "",
+        "samples of noisy pixels, spending those skipped on converged ones "
+        "[0 to disable]",
+        0);
+    aovs = ycmd::parse_flag(parser, "--aovs", "",
+                            "saves albedo, normal, depth and variance", false);
+    denoise = ycmd::parse_flag(parser, "--denoise", "",
+                               "denoises the image [offline only]", false);
+    denoise_params.iterations = ycmd::parse_opt<int>(
+        parser, "--denoise_iterations", "", "denoiser passes", 5);
+    stream = ycmd::parse_flag(
+        parser, "--stream", "",
+        "writes hdr rows while rendering, holding only a strip in memory "
+        "[offline only]",
+        false);
+    checkpoint = ycmd::parse_opt<std::string>(
+        parser, "--checkpoint", "",
+        "checkpoint file to resume from and save to [offline only]", "");
+    params.batch_samples = ycmd::parse_opt<int>(
+        parser, "--batch_samples", "",
+        "samples rendered between checkpoints and in each slice", 16);
+    params.direct_lights = ycmd::parse_opt<int>(
+        parser, "--direct_lights", "",
+        "lights sampled per point by direct [0 for all]", 0);
+    guiding = ycmd::parse_flag(
+        parser, "--guiding", "",
+        "learns incident radiance to guide paths [offline only]", false);
+    params.time_budget = ycmd::parse_opt<float>(
+        parser, "--time_budget", "",
+        "stops rendering after this many seconds [0 to disable]", 0);
+    params.target_error = ycmd::parse_opt<float>(
+        parser, "--target_error", "",
+        "stops rendering at this mean relative error [0 to disable]", 0);
+    sample_range[0] = ycmd::parse_opt<int>(
+        parser, "--sample_begin", "", "first sample of the slice to render", 0);
+    sample_range[1] = ycmd::parse_opt<int>(
+        parser, "--sample_end", "",
+        "end of the slice to render [-1 for all samples]", -1);
+    auto roi = ycmd::parse_opt<std::string>(
+        parser, "--roi", "",
+        "region refined interactively as x,y,w,h [empty for all]", "");
+    half_textures = ycmd::parse_flag(parser, "--half_textures", "",
+                                     "stores hdr textures as half floats",
+                                     false);
+    linear_ldr = ycmd::parse_flag(
+        parser, "--linear_ldr", "", "stores ldr textures as linear floats",
+        false);
     samples =
         ycmd::parse_opt<int>(parser, "--samples", "-s", "image samples", 256);
     aspect = ycmd::parse_opt<float>(parser, "--aspect", "-a", "image aspect",
                                     16.0f / 9.0f);
     res = ycmd::parse_opt<int>(parser, "--resolution", "-r", "image resolution",
                                720);
-    imfilename = ycmd::parse_opt<std::string>(parser, "--output", "-o",
-                                              "image filename", "out.hdr");
+    imfilename = ycmd::parse_opt<std::string>(
+        parser, "--output", "-o", "image filename [ytab for partial renders]",
+        "out.hdr");
     filename = ycmd::parse_arg<std::string>(parser, "scene", "scene filename",
                                             "", true);
     ycmd::check_parser(parser);
+    if (!roi.empty() && sscanf(roi.c_str(), "%d,%d,%d,%d", &roi_xy[0],
+                               &roi_xy[1], &roi_wh[0], &roi_wh[1]) != 4) {
+        printf("region of interest should be x,y,w,h\n");
+        return EXIT_FAILURE;
+    }
+    if (!roi.empty() && (roi_xy[0] < 0 || roi_xy[1] < 0 || roi_wh[0] <= 0 ||
+                         roi_wh[1] <= 0)) {
+        printf("region of interest should have non-negative origin and "
+               "positive size\n");
+        return EXIT_FAILURE;
+    }
+    if (frames <= 0) {
+        printf("frames should be positive\n");
+        return EXIT_FAILURE;
+    }
+    if (stream && ycmd::get_extension(imfilename) != ".hdr") {
+        printf("streaming supports only hdr images\n");
+        return EXIT_FAILURE;
+    }
+    if (stream && (params.adaptive || aovs || denoise || !checkpoint.empty() ||
+                   sample_range[0] != 0 ||
+                   (sample_range[1] >= 0 && sample_range[1] != samples) ||
+                   params.time_budget > 0 || params.target_error > 0 ||
+                   guiding)) {
+        printf("streaming does not support adaptive sampling, aovs, "
+               "denoising, checkpoints, slices, time budgets, target errors "
+               "or guiding\n");
+        return EXIT_FAILURE;
+    }
+    if (guiding && (!checkpoint.empty() || sample_range[0] != 0 ||
+                    (sample_range[1] >= 0 && sample_range[1] != samples) ||
+                    ycmd::get_extension(imfilename) == ".ytab")) {
+        printf("guiding does not support checkpoints or slices, since the "
+               "learned guide is not saved\n");
+        return EXIT_FAILURE;
+    }
 
     // setting up multithreading
     if (!nthreads) nthreads = std::thread::hardware_concurrency();
@@ -561,25 +862,36 @@ int main(int argc, char* argv[]) {
 
     // loading scene
     scene = yapp::load_scene(filename);
-    scene.cameras[camera].aspect = aspect;
+    for (auto& cam : scene.cameras) cam.aspect = aspect;
 
     // preparing raytracer
-    scene_bvh = make_bvh(scene);
-    trace_scene = make_trace_scene(scene, scene_bvh, camera);
+    scene_bvh = yapp::make_bvh(scene);
+    cutouts = make_cutouts(scene);
+    trace_scene = yapp::make_trace_scene(scene, half_textures, linear_ldr);
     params.stype =
         (camera_lights) ? ytrace::shader_type::eyelight : params.stype;
 
     // image rendering params
     auto width = (int)std::round(aspect * res), height = res;
-    hdr = ym::image<ym::vec4f>({width, height}, ym::zero4f);
-    ldr = ym::image<ym::vec4b>({width, height});
-    blocks = make_image_blocks(width, height, block_size);
+    if (!stream || !no_ui) {
+        hdr = ym::image<ym::vec4f>({width, height}, ym::zero4f);
+        ldr = ym::image<ym::vec4b>({width, height});
+    }
+    blocks = make_image_blocks(width, height, block_size, roi_xy, roi_wh);
+    if (blocks.empty()) {
+        printf("region of interest is outside the image\n");
+        return EXIT_FAILURE;
+    }
+    // the full resolution sample is left to the asynchronous block loop,
+    // which refines the region of interest only
+    preview_scales = ytrace::make_preview_schedule(block_size);
+    preview_scales.pop_back();
     texture_exposure = hdr_exposure;
     texture_gamma = hdr_gamma;
 
     // launching renderer
     if (no_ui) {
-        render_offline();
+        render_shots();
     } else {
         // run ui
         run_ui();
@@ -25,6 +25,8 @@
 //         hit = intersect_first(scene, ray data, out primitive intersection)
 //     - use intersect_any if you only need to know whether there is a hit
 //         hit = intersect_any(scene, ray data)
+//     - pass an any-hit filter to skip hits during traversal, e.g. for
+//       alpha-cutout surfaces
 //     - for points and lines, a radius is required
 //     - for triangle and tetrahedra, the radius is ignored
 // 4.b. perform closet-point tests
@@ -66,6 +68,8 @@
 // - to use as a .h, just #define YGL_DECLARATION before including this file
 // - to build as a .cpp, just #define YGL_IMPLEMENTATION before including this
 // file into only one file that you can either link directly or pack as a lib.
+// - the templated functions, like intersect_ray with an any-hit filter, are
+// always defined in the header, so they can be used in both modes
 //
 // This file depends on yocto_math.h.
 //
@@ -283,6 +287,30 @@ YGL_API point intersect_ray(const scene& scn, const ray3f& ray,
 YGL_API point intersect_ray(const shape& shp, const ray3f& ray,
                             bool early_exit);
 
+//
+// Intersect the scene with a ray, skipping the element hits rejected by an
+// any-hit filter. For each element hit during traversal, filter(pt) is called
+// with the intersection point and returns whether the hit is kept. Rejected
+// hits do not shorten the ray, so traversal continues in place instead of
+// restarting from the hit. Use this for alpha-cutout surfaces, by looking up
+// the alpha texture at the hit; with early_exit, shadow rays then skip the
+// cutout regions at the cost of a texture lookup. Since the filter is a
+// template parameter, it is inlined in the leaf loop.
+//
+// Parameters:
+// - scene/shape, ray, early_exit: see above
+// - filter: function object with signature bool(const point& pt)
+//
+// Return:
+// - closest (or any if early_exit) intersection point kept by filter
+//
+template <typename Filter>
+YGL_API point intersect_ray(const scene& scn, const ray3f& ray,
+                            bool early_exit, const Filter& filter);
+template <typename Filter>
+YGL_API point intersect_ray(const shape& shp, const ray3f& ray,
+                            bool early_exit, const Filter& filter);
+
 //
 // Returns a list of shape pairs that can possibly overlap by checking only they
 // axis aligned bouds. This is only a conservative check useful for collision
@@ -382,8 +410,12 @@ YGL_API void compute_bvh_stats(const scene& scn, bool include_shapes,
 // IMPLEMENTATION
 // -----------------------------------------------------------------------------
 
-// handles compilation options
-#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// The templated functions of the interface, and the helpers they use, are
+// compiled in all modes, since templates cannot be instantiated from the
+// .cpp half. Only the definitions of the non-templated interface are
+// guarded for YGL_DECLARATION.
+//
 
 #include <algorithm>
 #include <cstdio>
@@ -1265,6 +1297,7 @@ static inline void _make_node(bvhn& node, vector<bvhn>& nodes,
     }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Build a BVH from a set of primitives.
 //
@@ -1293,6 +1326,7 @@ YGL_API void _build_bvh(bvh& bvh, const vector<_bound_prim>& bound_prims,
         bvh.sorted_prim[i] = bound_prims[i].pid;
     }
 }
+#endif
 
 //
 // Gets the bbox of a shape element
@@ -1341,6 +1375,7 @@ static inline int _shape_nelems(const shape& shp) {
     }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Build a shape BVH. Public function whose interface is described above.
 //
@@ -1377,6 +1412,7 @@ YGL_API void build_bvh(scene& scn, heuristic_type htype, bool do_shapes) {
     // tree bvh
     _build_bvh(scn._bvh, bound_prims, htype);
 }
+#endif
 
 //
 // Recursively recomputes the node bounds for a shape bvh
@@ -1398,6 +1434,7 @@ static inline void _refit_bvh(T& obj, int nodeid) {
     }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Refits a scene BVH. Public function whose interface is described above.
 //
@@ -1415,11 +1452,13 @@ YGL_API void refit_bvh(scene& scn, bool do_shapes) {
     // recompute bvh bounds
     _refit_bvh(scn, 0);
 }
+#endif
 
 // -----------------------------------------------------------------------------
 // BVH INTERSECTION FUNCTIONS
 // -----------------------------------------------------------------------------
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Logging global variables
 //
@@ -1443,20 +1482,29 @@ YGL_API void get_ray_log(int& nrays, int& nbbox_inters, int& npoint_inters,
 }
 
 #endif
+#endif
+
+//
+// Any-hit filter that keeps all hits.
+//
+struct _accept_all_hits {
+    bool operator()(const point&) const { return true; }
+};
 
 //
 // Intersect a scene primitive. Used in the templated function below.
 //
+template <typename Filter>
 static inline point _intersect_ray(const scene& scn, int idx, const ray3f& ray,
-                                   bool early_exit) {
-    return intersect_ray(scn.shapes[idx], ray, early_exit);
+                                   bool early_exit, const Filter& filter) {
+    return intersect_ray(scn.shapes[idx], ray, early_exit, filter);
 }
 
 //
 // Intersect a shape element. Used in the templated function below.
 //
-static inline point _intersect_ray(const shape& shp, int idx, const ray3f& ray,
-                                   bool early_exit) {
+static inline point _intersect_elem(const shape& shp, int idx,
+                                    const ray3f& ray) {
     // initialize point
     auto pt = point();
 
@@ -1500,6 +1548,18 @@ static inline point _intersect_ray(const shape& shp, int idx, const ray3f& ray,
     return pt;
 }
 
+//
+// Intersect a shape element, applying the any-hit filter. Used in the
+// templated function below.
+//
+template <typename Filter>
+static inline point _intersect_ray(const shape& shp, int idx, const ray3f& ray,
+                                   bool early_exit, const Filter& filter) {
+    auto pt = _intersect_elem(shp, idx, ray);
+    if (pt && !filter(pt)) return {};
+    return pt;
+}
+
 //
 // Intersect ray with a bvh. Similar to the generic public function whose
 // interface is described above. See intersect_ray for parameter docs.
@@ -1514,10 +1574,12 @@ static inline point _intersect_ray(const shape& shp, int idx, const ray3f& ray,
 // traversal, we will speed up computation significantly while simplifying
 // the code; note in fact that all subsequence farthest iterations will be
 // rejected in the tmax tests
+// - Hits rejected by the filter are dropped at the shape leaves, so they
+// never update ray_tmax and the walk goes on as if they were missed
 //
-template <typename T>
+template <typename T, typename Filter>
 static inline point _intersect_ray(const T& obj, const ray3f& ray_,
-                                   bool early_exit) {
+                                   bool early_exit, const Filter& filter) {
     // get bvh
     auto& bvh = obj._bvh;
 
@@ -1570,7 +1632,7 @@ static inline point _intersect_ray(const T& obj, const ray3f& ray_,
             for (auto i = 0; i < node.count; i++) {
                 auto idx = bvh.sorted_prim[node.start + i];
                 auto pp = point();
-                if ((pp = _intersect_ray(obj, idx, ray, early_exit))) {
+                if ((pp = _intersect_ray(obj, idx, ray, early_exit, filter))) {
                     if (early_exit) return pp;
                     pt = pp;
                     ray.tmax = pt.dist;
@@ -1582,13 +1644,32 @@ static inline point _intersect_ray(const T& obj, const ray3f& ray_,
     return pt;
 }
 
+//
+// Shape intersection with any-hit filter
+//
+template <typename Filter>
+YGL_API point intersect_ray(const shape& shp, const ray3f& ray,
+                            bool early_exit, const Filter& filter) {
+    return _intersect_ray(shp, transform_ray_inverse(shp.frame, ray),
+                          early_exit, filter);
+}
+
+//
+// Scene intersection with any-hit filter
+//
+template <typename Filter>
+YGL_API point intersect_ray(const scene& scn, const ray3f& ray,
+                            bool early_exit, const Filter& filter) {
+    return _intersect_ray(scn, ray, early_exit, filter);
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Shape intersection
 //
 YGL_API point intersect_ray(const shape& shp, const ray3f& ray,
                             bool early_exit) {
-    return _intersect_ray(shp, transform_ray_inverse(shp.frame, ray),
-                          early_exit);
+    return intersect_ray(shp, ray, early_exit, _accept_all_hits());
 }
 
 //
@@ -1596,8 +1677,9 @@ YGL_API point intersect_ray(const shape& shp, const ray3f& ray,
 //
 YGL_API point intersect_ray(const scene& scn, const ray3f& ray,
                             bool early_exit) {
-    return _intersect_ray(scn, ray, early_exit);
+    return intersect_ray(scn, ray, early_exit, _accept_all_hits());
 }
+#endif
 
 // -----------------------------------------------------------------------------
 // BVH CLOSEST ELEMENT LOOKUP
@@ -1723,6 +1805,7 @@ static inline point _overlap_point(const T& obj, const vec3f& pos,
     return pt;
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Shape overlap
 //
@@ -1739,6 +1822,7 @@ YGL_API point overlap_point(const scene& scn, const vec3f& pos, float max_dist,
                             bool early_exit) {
     return _overlap_point(scn, pos, max_dist, early_exit);
 }
+#endif
 
 // -----------------------------------------------------------------------------
 // BVH CLOSEST ELEMENT LOOKUP FOR INTERNAL ELEMENTS
@@ -1931,6 +2015,7 @@ static inline void _overlap_verts(const T& obj1, const T& obj2,
     }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Find the list of overlaps between shapes.
 // Public function whose interface is described above.
@@ -1957,6 +2042,7 @@ YGL_API void overlap_verts(const scene& scn1, const scene& scn2,
                       radius, first_only, overlaps);
     }
 }
+#endif
 
 //
 // Finds the overlap between shape bounds.
@@ -2037,6 +2123,7 @@ static inline void _overlap_shape_bounds(const scene& scn1, const scene& scn2,
     }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Find the list of overlaps between shape bounds.
 // Public function whose interface is described above.
@@ -2048,6 +2135,7 @@ YGL_API void overlap_shape_bounds(const scene& scn1, const scene& scn2,
     _overlap_shape_bounds(scn1, scn2, conservative, skip_duplicates, skip_self,
                           overlaps);
 }
+#endif
 
 // -----------------------------------------------------------------------------
 // VERTEX PROPERTY INTERPOLATION
@@ -2084,6 +2172,7 @@ YGL_API T interpolate_shape_vert(const array_view<int>& points,
 // STATISTICS FOR DEBUGGING (probably not helpful to all)
 // -----------------------------------------------------------------------------
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Compute BVH stats.
 //
@@ -2151,9 +2240,8 @@ YGL_API void compute_bvh_stats(const scene& scn, bool include_shapes,
     _compute_bvh_stats(scn, req_shape, include_shapes, 0, nprims, ninternals,
                        nleaves, min_depth, max_depth);
 }
+#endif
 
 }  // namespace
 
 #endif
-
-#endif
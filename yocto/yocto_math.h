@@ -9,6 +9,8 @@
 // - rays
 // - random number generation via PCG32
 // - a few hash functions
+// - alias tables for sampling discrete distributions in constant time
+// - half-precision float storage with conversions
 // - timer (depends on C++11 chrono)
 //
 // While we tested this library in the implementation of our other ones, we
@@ -94,6 +96,7 @@
 #include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <initializer_list>
 #include <limits>
@@ -101,6 +104,10 @@
 #include <unordered_map>
 #include <vector>
 
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
 // -----------------------------------------------------------------------------
 // CONSTANTS
 // -----------------------------------------------------------------------------
@@ -1710,6 +1717,159 @@ struct array_view {
     T* _data;
 };
 
+// -----------------------------------------------------------------------------
+// ALIAS TABLES
+// -----------------------------------------------------------------------------
+
+//
+// Turns the weights in prob into an alias table with Vose's method, so that
+// entries can be picked in constant time with sample_alias, and returns the
+// total weight. From "A Linear Algorithm For Generating Random Numbers With
+// a Given Distribution" [Vose 1991].
+//
+inline float make_alias_table(array_view<float> prob, array_view<int> alias) {
+    auto n = (int)prob.size();
+    auto weight = 0.0f;
+    for (auto i = 0; i < n; i++) weight += prob[i];
+
+    // split entries in under and over full
+    auto small = vector<int>(), large = vector<int>();
+    for (auto i = 0; i < n; i++) {
+        prob[i] *= n / weight;
+        alias[i] = i;
+        if (prob[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    // fill each small entry with the excess of a large one
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+        alias[s] = l;
+        prob[l] -= 1 - prob[s];
+        if (prob[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // remaining entries are full up to numerical precision
+    for (auto i : small) prob[i] = 1;
+    for (auto i : large) prob[i] = 1;
+    return weight;
+}
+
+//
+// Picks an entry of an alias table, using the residual of ern to choose
+// between the entry and its alias.
+//
+inline int sample_alias(const array_view<float>& prob,
+                        const array_view<int>& alias, float ern) {
+    auto n = (int)prob.size();
+    auto i = min((int)(ern * n), n - 1);
+    return (ern * n - i < prob[i]) ? i : alias[i];
+}
+
+// -----------------------------------------------------------------------------
+// HALF-PRECISION FLOATS
+// -----------------------------------------------------------------------------
+
+//
+// Half-precision float, stored as the bits of an IEEE 754 binary16 number.
+// This is only a storage type, so convert values to float to compute on them.
+//
+struct half {
+    uint16_t bits = 0;
+};
+
+//
+// Typedef for half vectors.
+//
+using vec4h = vec<half, 4>;
+
+//
+// Converts a half to float. Uses F16C when compiled for it. Otherwise it
+// rebiases the exponent with integer ops and fixes denormals with a float
+// subtraction.
+//
+inline float half_to_float(half h) {
+#ifdef __F16C__
+    return _cvtsh_ss(h.bits);
+#else
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    auto u = (uint32_t)(h.bits & 0x7fffu) << 13;
+    auto exp = u & shifted_exp;
+    u += (uint32_t)(127 - 15) << 23;
+    if (exp == shifted_exp) {
+        u += (uint32_t)(128 - 16) << 23;  // inf or nan
+    } else if (exp == 0) {
+        // denormal: renormalize with a float subtraction
+        u += 1u << 23;
+        auto magic = (uint32_t)113 << 23;
+        float f, m;
+        std::memcpy(&f, &u, 4);
+        std::memcpy(&m, &magic, 4);
+        f -= m;
+        std::memcpy(&u, &f, 4);
+    }
+    u |= (uint32_t)(h.bits & 0x8000u) << 16;
+    auto f = 0.0f;
+    std::memcpy(&f, &u, 4);
+    return f;
+#endif
+}
+
+//
+// Converts a float to half, rounding to nearest even. Values out of range
+// become infinities and nans stay nans. Uses F16C when compiled for it.
+//
+inline half float_to_half(float f) {
+#ifdef __F16C__
+    return {(uint16_t)_cvtss_sh(f, 0)};
+#else
+    const uint32_t f32_inf = 255u << 23;
+    const uint32_t f16_max = (127u + 16u) << 23;
+    const uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+    auto u = 0u;
+    std::memcpy(&u, &f, 4);
+    auto sign = u & 0x80000000u;
+    u ^= sign;
+    auto o = 0u;
+    if (u >= f16_max) {
+        o = (u > f32_inf) ? 0x7e00u : 0x7c00u;
+    } else if (u < (113u << 23)) {
+        // denormal: let the float addition round the mantissa
+        float v, m;
+        std::memcpy(&v, &u, 4);
+        std::memcpy(&m, &denorm_magic, 4);
+        v += m;
+        std::memcpy(&u, &v, 4);
+        o = u - denorm_magic;
+    } else {
+        auto mant_odd = (u >> 13) & 1u;
+        u += ((uint32_t)(15 - 127) << 23) + 0xfffu;
+        u += mant_odd;
+        o = u >> 13;
+    }
+    return {(uint16_t)(o | (sign >> 16))};
+#endif
+}
+
+//
+// Converts half vectors to and from float ones.
+//
+inline vec4f half_to_float(const vec4h& h) {
+    return {half_to_float(h[0]), half_to_float(h[1]), half_to_float(h[2]),
+            half_to_float(h[3])};
+}
+inline vec4h float_to_half(const vec4f& f) {
+    auto h = vec4h();
+    for (auto i = 0; i < 4; i++) h[i] = float_to_half(f[i]);
+    return h;
+}
+
 // -----------------------------------------------------------------------------
 // IMAGES
 // -----------------------------------------------------------------------------
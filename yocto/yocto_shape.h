@@ -33,6 +33,9 @@
 //      sample_shape_cdf(shape definition, out cdf)
 // 4.b. generate elements ids and uvs for each point by repeatedly call
 //      sample_shape(cdf, random numbers, out element id and uv)
+// 4.c. alternatively, compute an alias table to sample in constant time
+//      sample_shape_alias(shape definition, out prob, out alias)
+//      sample_shape(prob, alias, random numbers, out element id and uv)
 // 5. interpolate vertex data linearly over primitives
 //    interpolate_vert(element data, vertex data, out vertex value)
 // 6. [support] make a dictionary of unique undirected edges from elements
@@ -361,6 +364,40 @@ YGL_API void sample_shape_cdf(const array_view<vec3i>& triangles,
                               const array_view<vec3f>& pos,
                               array_view<float> ecdf, float& area);
 
+//
+// Computes an alias table of the area of shape elements for sampling. Unlike
+// the cdf above, elements are sampled in constant time. In the case of the
+// sample_shape_alias version, only one element array can be non-empty at any
+// given call.
+//
+// Paramaters:
+// - elem: element array
+// - pos: vertex positions
+//
+// Out Parameters:
+// - eprob: array of probabilities of keeping each table entry
+// - ealias: array of aliases of each table entry
+// - area: total area of the shape (or length for lines)
+//
+YGL_API void sample_shape_alias(const array_view<int>& points,
+                                const array_view<vec2i>& lines,
+                                const array_view<vec3i>& triangles,
+                                const array_view<vec3f>& pos,
+                                array_view<float> eprob,
+                                array_view<int> ealias, float& area);
+YGL_API void sample_shape_alias(const array_view<int>& points,
+                                const array_view<vec3f>& pos,
+                                array_view<float> eprob,
+                                array_view<int> ealias, float& num);
+YGL_API void sample_shape_alias(const array_view<vec2i>& lines,
+                                const array_view<vec3f>& pos,
+                                array_view<float> eprob,
+                                array_view<int> ealias, float& length);
+YGL_API void sample_shape_alias(const array_view<vec3i>& triangles,
+                                const array_view<vec3f>& pos,
+                                array_view<float> eprob,
+                                array_view<int> ealias, float& area);
+
 //
 // Sampels a shape elements. In the case of the sample_shape version, only one
 // cdf can be non-empty at any given call.
@@ -385,6 +422,20 @@ YGL_API void sample_shape(const array_view<float>& line_cdf, float ern,
 YGL_API void sample_shape(const array_view<float>& triangle_cdf, float ern,
                           const vec2f& uvrn, int& eid, vec2f& euv);
 
+//
+// Sampels a shape elements using the alias tables from sample_shape_alias.
+// Parameters are as above.
+//
+YGL_API void sample_shape(const array_view<float>& point_prob,
+                          const array_view<int>& point_alias, float ern,
+                          int& eid);
+YGL_API void sample_shape(const array_view<float>& line_prob,
+                          const array_view<int>& line_alias, float ern,
+                          float uvrn, int& eid, float& euv);
+YGL_API void sample_shape(const array_view<float>& triangle_prob,
+                          const array_view<int>& triangle_alias, float ern,
+                          const vec2f& uvrn, int& eid, vec2f& euv);
+
 //
 // Interpolates a vertex property using baricentric interpolation. Uses
 // linear interpolation for lines, baricentric for triangles and copies values
@@ -780,6 +831,87 @@ YGL_API void sample_shape(const array_view<float>& point_cdf,
         assert(false);
 }
 
+//
+// Sample alias table. Public API described above.
+//
+YGL_API void sample_shape_alias(const array_view<int>& elems,
+                                const array_view<vec3f>& pos,
+                                array_view<float> prob, array_view<int> alias,
+                                float& weight) {
+    for (auto i = 0; i < elems.size(); i++) prob[i] = 1;
+    weight = make_alias_table(prob, alias);
+}
+
+//
+// Sample alias table. Public API described above.
+//
+YGL_API void sample_shape_alias(const array_view<vec2i>& elems,
+                                const array_view<vec3f>& pos,
+                                array_view<float> prob, array_view<int> alias,
+                                float& weight) {
+    for (auto i = 0; i < elems.size(); i++) {
+        auto& f = elems[i];
+        prob[i] = length(pos[f[0]] - pos[f[1]]);
+    }
+    weight = make_alias_table(prob, alias);
+}
+
+//
+// Sample alias table. Public API described above.
+//
+YGL_API void sample_shape_alias(const array_view<vec3i>& elems,
+                                const array_view<vec3f>& pos,
+                                array_view<float> prob, array_view<int> alias,
+                                float& weight) {
+    for (auto i = 0; i < elems.size(); i++) {
+        auto& f = elems[i];
+        prob[i] =
+            length(cross(pos[f[0]] - pos[f[1]], pos[f[0]] - pos[f[2]])) / 2;
+    }
+    weight = make_alias_table(prob, alias);
+}
+
+//
+// Sample alias table. Public API described above.
+//
+YGL_API void sample_shape_alias(const array_view<int>& points,
+                                const array_view<vec2i>& lines,
+                                const array_view<vec3i>& triangles,
+                                const array_view<vec3f>& pos,
+                                array_view<float> prob, array_view<int> alias,
+                                float& weight) {
+    if (!points.empty()) {
+        sample_shape_alias(points, pos, prob, alias, weight);
+    } else if (!lines.empty()) {
+        sample_shape_alias(lines, pos, prob, alias, weight);
+    } else if (!triangles.empty()) {
+        sample_shape_alias(triangles, pos, prob, alias, weight);
+    } else
+        assert(false);
+}
+
+//
+// Sample shape with alias tables. Public API described above.
+//
+YGL_API void sample_shape(const array_view<float>& prob,
+                          const array_view<int>& alias, float ern, int& eid) {
+    eid = sample_alias(prob, alias, ern);
+}
+
+YGL_API void sample_shape(const array_view<float>& prob,
+                          const array_view<int>& alias, float ern, float uvrn,
+                          int& eid, float& euv) {
+    eid = sample_alias(prob, alias, ern);
+    euv = uvrn;
+}
+
+YGL_API void sample_shape(const array_view<float>& prob,
+                          const array_view<int>& alias, float ern,
+                          const vec2f& uvrn, int& eid, vec2f& euv) {
+    eid = sample_alias(prob, alias, ern);
+    euv = {1 - sqrtf(uvrn[0]), uvrn[1] * sqrtf(uvrn[0])};
+}
+
 //
 // Interpolate vertex properties. Public API.
 //
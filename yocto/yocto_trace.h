@@ -24,11 +24,17 @@
 //     scn.intersect_first = <callback>
 //     scn.intersect_any = <callback>
 //     - can use yocto_bvh
+//     - for speed, the intersection routines can instead be passed directly
+//       to the templated trace_block to bind them at compile time
 // 2. prepare for rendering
 //    init_lights(scene)
+//    init_textures(scene) [optional, for mip-mapping]
+//    compile_scene(scene) [optional, for faster shading]
 // 3. define rendering params
 // 4. render blocks of samples
 //    render_block(scn, pixels, image size, block)
+//    - for interactive use, trace_preview renders a crop window at reduced
+//      resolution, following make_preview_schedule from coarse to fine
 //
 // The interface for each function is described in details in the interface
 // section of this file.
@@ -48,6 +54,17 @@
 // general (you can even more an arbitrary shape sun). For now only the first
 // env is used.
 //
+// Environments with an emission texture are sampled proportionally to the
+// texture emission, so that small bright sources like the sun are found by
+// light sampling.
+//
+// In path tracing, emitters are picked using a light tree built by
+// init_lights over the elements of all emissive points and triangles. The tree
+// is traversed picking children by their estimated contribution, so that
+// scenes with many small lights converge at a rate that does not depend on
+// their number. The direct shader loops over all lights, unless
+// params.direct_lights asks to pick only a few of them with the tree.
+//
 // We generate our own random numbers guarantying that there is one random
 // sequence per path. This means you can rul the path tracer in any order
 // serially or in parallel.
@@ -64,6 +81,9 @@
 // - to use as a .h, just #define YGL_DECLARATION before including this file
 // - to build as a .cpp, just #define YGL_IMPLEMENTATION before including this
 // file into only one file that you can either link directly or pack as a lib.
+// - the templated functions, like trace_block with intersection routines bound
+// at compile time, are always defined in the header, so they can be used in
+// both modes
 //
 // This file depends on yocto_math.h.
 //
@@ -112,7 +132,10 @@
 #define YGL_API
 #endif
 
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <string>
 #include "yocto_math.h"
 
 // -----------------------------------------------------------------------------
@@ -136,6 +159,19 @@ enum struct shader_type {
     pathtrace,  // path tracing
 };
 
+//
+// Auxiliary outputs (AOVs) that can be extracted from an accumulation buffer
+//
+enum struct aov_type {
+    albedo = 0,   // first hit albedo
+    normal,       // first hit world-space normal
+    depth,        // first hit distance from the camera
+    shape_id,     // first hit shape id, or -1
+    material_id,  // first hit material id, or -1
+    variance,     // variance of the sample luminance
+    samples,      // number of samples
+};
+
 //
 // Random number generator type
 //
@@ -144,6 +180,7 @@ enum struct rng_type {
     uniform,     // uniform random numbers
     stratified,  // stratified random numbers
     cmjs,        // correlated multi-jittered sampling
+    sobol,       // owen-scrambled sobol sequence
 };
 
 //
@@ -157,12 +194,31 @@ struct camera {
     float focus = 1;                   // focus plane distance (cannot be zero)
 };
 
+//
+// Mip level of a texture, stored in tiles of 8x8 texels so that filtered
+// lookups touch few cache lines. Only one of hdr or ldr is filled.
+// This is only used internally and should not be created.
+//
+struct texture_level {
+    vec2i size = {0, 0};  // level size
+    int ntiles = 0;       // number of tiles in each row
+    vector<vec4f> hdr;    // tiled hdr texels
+    vector<vec4b> ldr;    // tiled ldr texels
+    vector<vec4h> hdrh;   // tiled half hdr texels
+};
+
 //
 // Texture
 //
 struct texture {
     image_view<vec4f> hdr;
     image_view<vec4b> ldr;
+    image_view<vec4h> hdrh;   // half hdr data, used if hdr and ldr are empty
+    bool linear_ldr = false;  // store ldr mip levels as linear floats
+    bool half_mips = false;   // store hdr mip levels as half floats
+
+    // [private] mip pyramid
+    vector<texture_level> _mips;  // tiled mip levels [private]
 };
 
 //
@@ -260,8 +316,103 @@ using intersect_any_cb = function<bool(const ray3f& ray)>;
 struct light {
     int shape_id = -1;  // shape
     int env_id = -1;    // environment
-    vector<float> cdf;  // for shape, cdf of shape elements for sampling
+    vector<float> prob;  // for shape, alias table probabilities for sampling
+    vector<int> alias;   // for shape, alias table aliases for sampling
     float area = 0;     // for shape, shape area
+    vector<int> leaves;  // for shape, light tree leaf of each element
+    vector<float> env_rows;  // for env map, cdf of texture rows
+    vector<float> env_cols;  // for env map, cdf of texels in each row
+};
+
+//
+// Node of the light tree, a hierarchy over the emissive shape elements that
+// bounds their position, orientation and power. Leaves hold one element.
+// This is only used internally and should not be created.
+//
+struct light_node {
+    bbox3f bbox = invalid_bbox3f;  // bounds of the emitters
+    vec3f axis = {0, 0, 1};        // axis of the normals cone
+    float cos_o = 1;               // cosine of the normals cone spread
+    float cos_e = 0;               // cosine of the emission spread
+    float power = 0;               // emitted power
+    int parent = -1;               // parent node
+    int child = -1;                // first of two children or -1 for leaves
+    int light_id = -1;             // for leaves, light
+    int elem_id = -1;              // for leaves, light element
+};
+
+//
+// Material record with the values needed for shading, used by compiled
+// scenes. This is only used internally and should not be created.
+//
+struct compiled_material {
+    vec3f ke = zero3f;       // emission
+    vec3f kd = zero3f;       // diffuse
+    vec3f ks = zero3f;       // specular
+    float rs = 0.1;          // specular roughness
+    bool use_phong = false;  // whether to use phong
+    int ke_txt = -1;         // emission texture
+    int kd_txt = -1;         // diffuse texture
+    int ks_txt = -1;         // specular texture
+    int rs_txt = -1;         // roughness texture
+    bool textured = false;   // whether any texture is set
+};
+
+//
+// Shape with world-space vertex data and its material record, used by
+// compiled scenes. Elements are stored as nverts vertex indices each.
+// This is only used internally and should not be created.
+//
+struct compiled_shape {
+    int nverts = 0;              // vertices per element (1, 2 or 3)
+    const int* elems = nullptr;  // element vertex indices
+    vector<vec3f> pos;           // world-space positions
+    vector<vec3f> norm;          // world-space normals
+    array_view<vec2f> texcoord;  // texture coordinates
+    array_view<vec3f> color;     // vertex colors
+    compiled_material mat;       // material
+};
+
+//
+// Node of the directional quadtrees used for path guiding. Directions are
+// mapped to the unit square, which each node splits in four quadrants
+// ordered by x first.
+//
+struct guide_dnode {
+    float sum[4] = {0, 0, 0, 0};      // energy of each quadrant
+    int child[4] = {-1, -1, -1, -1};  // node of each quadrant or -1 for leaves
+};
+
+//
+// Distribution of incident radiance in a region of space for path guiding.
+// Directions are sampled from the tree learned in the previous pass, while
+// the samples of the current pass are recorded in the leaves of the same
+// tree.
+//
+struct guide_dtree {
+    vector<guide_dnode> nodes;                      // quadtree nodes
+    float sum = 0;                                  // total energy
+    std::unique_ptr<std::atomic<float>[]> record;  // energy in each quadrant
+    std::atomic<int> count{0};                      // samples recorded
+};
+
+//
+// Node of the spatial tree used for path guiding. Each node splits its box
+// in half along axis, with the two children stored adjacently.
+//
+struct guide_snode {
+    int axis = 0;    // split axis
+    int child = -1;  // first of two children or -1 for leaves
+    int dtree = -1;  // for leaves, directional tree
+};
+
+//
+// Path guiding data learned over rendering passes.
+//
+struct path_guide {
+    bbox3f bbox = invalid_bbox3f;                  // bounds of the scene
+    vector<guide_snode> nodes;                     // spatial tree nodes
+    vector<std::unique_ptr<guide_dtree>> dtrees;  // directional trees
 };
 
 //
@@ -280,7 +431,13 @@ struct scene {
     vector<texture> textures;          // textures
 
     // [private] light sources
-    vector<light> _lights;  // lights [private]
+    vector<light> _lights;           // lights [private]
+    vector<light_node> _light_tree;  // tree over shape lights [private]
+    vector<int> _shape_lights;       // light of each shape or -1 [private]
+    vector<int> _env_lights;         // environment lights [private]
+
+    // [private] compiled shapes
+    vector<compiled_shape> _compiled_shapes;  // render-ready shapes [private]
 };
 
 //
@@ -294,6 +451,58 @@ struct render_params {
     int max_depth = 8;                     // mas ray depth
     float pixel_clamp = 100;               // final pixel clamping
     float ray_eps = 1e-2f;                 // ray intersection epsilon
+    int direct_lights = 0;                 // sampled lights per point [0 = all]
+
+    // adaptive sampling [only for accum_buffer rendering]
+    bool adaptive = false;          // stop sampling converged pixels
+    float adaptive_error = 0.01f;   // relative error of converged pixels
+    int adaptive_min_samples = 16;  // samples taken before testing the error
+    int adaptive_max_samples = 0;   // samples of noisy pixels [0 for ns]
+
+    // progressive rendering [only for trace_image_progressive]
+    int batch_samples = 16;  // samples rendered in each batch
+    float time_budget = 0;   // time limit in seconds [0 for none]
+    float target_error = 0;  // mean relative error to reach [0 for none]
+};
+
+//
+// Denoising params. Each weight falls off with the squared difference of the
+// guides over the square of its sigma.
+//
+struct denoise_params {
+    int iterations = 5;         // filter passes, with radius 2^iterations
+    float sigma_color = 0.1f;   // color weight [halved at each pass]
+    float sigma_albedo = 0.1f;  // albedo weight
+    float sigma_normal = 0.1f;  // normal weight
+    float sigma_depth = 0.05f;  // relative depth weight, per pixel of distance
+};
+
+//
+// Accumulation buffer for progressive and adaptive rendering. For each pixel
+// it stores the sum of the samples, the sum of the squared sample luminance
+// and the number of samples, from which we estimate the pixel value and its
+// variance. Optionally, it also sums the properties of the first hit of each
+// sample, for denoising and compositing. Ids are taken from the first sample.
+// The buffer also records the settings that determine the random sequences
+// of its samples, since only samples drawn with the same settings can be
+// added together.
+//
+struct accum_buffer {
+    image<vec4f> sum;        // sum of samples
+    image<float> sum2;       // sum of squared sample luminance
+    image<int> count;        // number of samples
+    vec2i samples = {0, 0};  // range of sample indices traced
+
+    // render settings [set by trace_image_parallel]
+    int ns = 0;                            // samples of the random sequences
+    rng_type rtype = rng_type::def;        // random type
+    shader_type stype = shader_type::def;  // shader type
+
+    // auxiliary outputs [only if created with aovs]
+    image<vec3f> albedo;  // sum of first hit albedo
+    image<vec3f> normal;  // sum of first hit normals
+    image<float> depth;   // sum of first hit distances
+    image<vec2i> ids;     // first hit shape and material ids
 };
 
 //
@@ -307,13 +516,64 @@ YGL_API float specular_exponent_to_roughness(float n);
 YGL_API void specular_fresnel_from_ks(const vec3f& ks, vec3f& es, vec3f& esk);
 
 //
-// Initialize rendering.
+// Initialize rendering. Builds the light list and the light tree.
 //
 // Parameters:
 // - scn: trace scene
 //
 YGL_API void init_lights(scene& scn);
 
+//
+// Builds tiled mip pyramids for all scene textures. Lookups then pick the
+// level matching the footprint of the ray, tracked as a cone from the
+// camera. Without this call, textures are sampled at full resolution.
+// Call again if textures change.
+//
+// LDR textures are kept as bytes and decoded with a lookup table, unless
+// linear_ldr is set on the texture. In that case they are converted once to
+// linear floats, which takes four times the memory but skips decoding.
+//
+// Parameters:
+// - scn: trace scene
+//
+YGL_API void init_textures(scene& scn);
+
+//
+// Compiles shapes into render-ready records, with vertex positions and
+// normals in world space, elements in a flat array with a fixed number of
+// vertices and a copy of their material. Shading then avoids transforms and
+// indirections. Call again if shapes or materials change.
+//
+// Parameters:
+// - scn: trace scene
+//
+YGL_API void compile_scene(scene& scn);
+
+//
+// Initializes a path guide for the scene, clearing what was learned before.
+// When a guide is passed to trace_image_progressive, the path tracer samples
+// indirect rays from the learned incident radiance and the brdf, combined
+// with multiple importance sampling, and records the radiance it finds in
+// the guide. What was recorded is used for sampling after update_guiding is
+// called, which trace_image_progressive does after each batch.
+//
+// Parameters:
+// - scn: trace scene
+// - guide: path guide
+//
+YGL_API void init_guiding(const scene& scn, path_guide& guide);
+
+//
+// Updates path guiding with the radiance recorded in the last pass and
+// starts a new one. Regions of space with many samples are split and the
+// directional distributions are refined where they have more energy.
+//
+// Parameters:
+// - guide: path guide
+// - ns: number of samples per pixel of the last pass
+//
+YGL_API void update_guiding(path_guide& guide, int ns);
+
 //
 // Renders a block of sample
 //
@@ -338,61 +598,563 @@ YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
                          const vec2i& samples, const render_params& params,
                          bool accumulate = false);
 
+//
+// Renders a block of sample with intersection routines bound at compile time.
+// Same as above, but the scene callbacks are replaced by the function objects
+// intersect_first and intersect_any, with the same signature of
+// intersect_first_cb and intersect_any_cb. Since the shaders are instantiated
+// for the given types, passing lambdas that call the acceleration structure
+// directly (e.g. ybvh::intersect_ray) removes the per-ray indirection.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
+                         int ns, const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params,
+                         const Intersect_first& intersect_first,
+                         const Intersect_any& intersect_any,
+                         bool accumulate = false);
+
+//
+// Creates an empty accumulation buffer of the given size. If aovs is true,
+// the auxiliary outputs are also accumulated when rendering into it.
+//
+YGL_API accum_buffer make_accum_buffer(const vec2i& size, bool aovs = false);
+
+//
+// Renders a block of samples into an accumulation buffer. Samples are always
+// added to the ones already in the buffer. If params.adaptive is set, pixels
+// whose estimated error is below params.adaptive_error after at least
+// params.adaptive_min_samples samples are not sampled further. Here noisy
+// pixels still stop at ns, so adaptive sampling lowers the cost of a render;
+// trace_image_progressive can instead spend the skipped samples on the noisy
+// pixels. Parameters are as in trace_block, with ns used as the maximum
+// number of samples of each pixel. The samples of each call are summed
+// before being added to the buffer.
+//
+YGL_API void trace_block(const scene& scn, int cid, accum_buffer& buf, int ns,
+                         const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params);
+
+//
+// Renders a block of samples into an accumulation buffer with intersection
+// routines bound at compile time. See above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_block(const scene& scn, int cid, accum_buffer& buf, int ns,
+                         const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params,
+                         const Intersect_first& intersect_first,
+                         const Intersect_any& intersect_any);
+
+//
+// Computes pixel values from an accumulation buffer for the block xy, wh
+// (the whole image by default).
+//
+YGL_API void resolve_block(const accum_buffer& buf, image_view<vec4f> img,
+                           const vec2i& xy = {0, 0},
+                           const vec2i& wh = {-1, -1});
+
+//
+// Computes pixel values from an accumulation buffer as half floats, halving
+// the size of the framebuffer. The buffer keeps float sums, since halfs
+// cannot add up many samples without losing them.
+//
+YGL_API void resolve_block(const accum_buffer& buf, image_view<vec4h> img,
+                           const vec2i& xy = {0, 0},
+                           const vec2i& wh = {-1, -1});
+
+//
+// Computes an auxiliary output from an accumulation buffer for the block xy,
+// wh (the whole image by default). Values are stored in the first channels
+// of img, with the rest set to zero and alpha to one. Albedo, normal, depth
+// and ids require a buffer created with aovs. For misses, albedo is the
+// emission of the environment, normal and depth are zero and ids are -1.
+//
+YGL_API void resolve_aov(const accum_buffer& buf, aov_type type,
+                         image_view<vec4f> img, const vec2i& xy = {0, 0},
+                         const vec2i& wh = {-1, -1});
+
+//
+// Saves an accumulation buffer to a binary checkpoint file, with a small
+// header followed by the pixel data in native byte order. Rendering can be
+// resumed from the buffer loaded back with load_accum_buffer by tracing the
+// samples after buf.samples.
+//
+YGL_API bool save_accum_buffer(const std::string& filename,
+                               const accum_buffer& buf, std::string& errmsg);
+
+//
+// Loads an accumulation buffer from a checkpoint file. See above.
+//
+YGL_API bool load_accum_buffer(const std::string& filename, accum_buffer& buf,
+                               std::string& errmsg);
+
+//
+// Merges the samples of other into buf. The buffers must have the same size,
+// aovs and render settings, and the sample range of other must start where
+// the one of buf ends. An empty buf is replaced by other. Merging in order buffers that
+// were each rendered with a single call gives bit for bit the buffer of
+// rendering the same calls in sequence.
+//
+YGL_API bool merge_accum_buffers(accum_buffer& buf, const accum_buffer& other,
+                                 std::string& errmsg);
+
+//
+// Checks whether a pixel in the accumulation buffer has converged according
+// to the adaptive sampling params.
+//
+YGL_API bool is_pixel_converged(const accum_buffer& buf, const vec2i& ij,
+                                const render_params& params);
+
 //
 // Convenience function to call trace_block with all sample at once.
 //
 YGL_API void trace_image(const scene& scn, int cid, image_view<vec4f> img,
                          int ns, const render_params& params);
 
+//
+// Renders the image in parallel. The image is split into blocks that are
+// ordered along a Hilbert curve and distributed in contiguous runs to
+// per-thread queues. Threads that run out of work steal blocks from the
+// others. Each block is rendered for the whole sample range at once, so
+// threads never wait on each other between samples.
+//
+// Parameters:
+// - scn, cid, img, ns, samples, params, accumulate: see trace_block
+// - nthreads: number of threads (0 for hardware concurrency)
+// - block_size: size of the image blocks
+//
+YGL_API void trace_image_parallel(const scene& scn, int cid,
+                                  image_view<vec4f> img, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params, int nthreads = 0,
+                                  int block_size = 32, bool accumulate = false);
+
+//
+// Renders the image in parallel with intersection routines bound at compile
+// time. See the templated trace_block for details.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_image_parallel(const scene& scn, int cid,
+                                  image_view<vec4f> img, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads = 0, int block_size = 32,
+                                  bool accumulate = false);
+
+//
+// Renders in parallel the rows of an image of the given size from row to
+// row + strip.size()[1], storing them in strip. Rendering a large image a
+// strip at a time bounds memory to the strip, e.g. when streaming the
+// finished rows to disk.
+//
+// Parameters:
+// - scn, cid, ns, samples, params: see trace_block
+// - size: size of the whole image
+// - row: first image row of the strip
+// - strip: pixel data of the strip rows
+// - nthreads, block_size: see trace_image_parallel
+//
+YGL_API void trace_strip_parallel(const scene& scn, int cid, const vec2i& size,
+                                  int row, image_view<vec4f> strip, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params, int nthreads = 0,
+                                  int block_size = 32);
+
+//
+// Renders a strip of rows of the image in parallel with intersection
+// routines bound at compile time.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_strip_parallel(const scene& scn, int cid, const vec2i& size,
+                                  int row, image_view<vec4f> strip, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads = 0, int block_size = 32);
+
+//
+// Renders a preview of the pixels of img in the window xy, wh (the whole
+// image by default) at a resolution reduced by scale. Each scale x scale
+// cell of the window is traced with one sample, the first of ns, at its
+// center and the result is copied to all its pixels. At scale 1 this is the
+// first sample of each pixel, so refinement can continue with trace_block
+// accumulating samples from 1 on. Pixels outside the window are left
+// untouched.
+//
+// Parameters:
+// - scn, cid, img, ns, params: see trace_block
+// - scale: size in pixels of the preview cells
+// - xy, wh: window to render
+// - nthreads, block_size: see trace_image_parallel
+//
+YGL_API void trace_preview(const scene& scn, int cid, image_view<vec4f> img,
+                           int ns, int scale, const render_params& params,
+                           const vec2i& xy = {0, 0}, const vec2i& wh = {-1, -1},
+                           int nthreads = 0, int block_size = 32);
+
+//
+// Renders a preview with intersection routines bound at compile time. See
+// above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_preview(const scene& scn, int cid, image_view<vec4f> img,
+                           int ns, int scale, const render_params& params,
+                           const Intersect_first& intersect_first,
+                           const Intersect_any& intersect_any,
+                           const vec2i& xy = {0, 0}, const vec2i& wh = {-1, -1},
+                           int nthreads = 0, int block_size = 32);
+
+//
+// Coarse-to-fine schedule of preview scales, halving from the largest power
+// of two not above max_scale down to 1. Calling trace_preview for each scale
+// in turn refines the preview after a camera move, with the first ones
+// taking a fraction of the time of a full sample.
+//
+YGL_API vector<int> make_preview_schedule(int max_scale);
+
+//
+// Renders the image in parallel into an accumulation buffer. See above and
+// the accum_buffer version of trace_block. Also records the render settings
+// in buf and extends buf.samples with the rendered range, which should
+// follow the one already in the buffer.
+//
+YGL_API void trace_image_parallel(const scene& scn, int cid, accum_buffer& buf,
+                                  int ns, const vec2i& samples,
+                                  const render_params& params, int nthreads = 0,
+                                  int block_size = 32);
+
+//
+// Renders the image in parallel into an accumulation buffer with
+// intersection routines bound at compile time.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_image_parallel(const scene& scn, int cid, accum_buffer& buf,
+                                  int ns, const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads = 0, int block_size = 32);
+
+//
+// Renders the image progressively into an accumulation buffer, in batches
+// of params.batch_samples samples, continuing after the samples already in
+// the buffer. Rendering stops after ns samples, when the next batch would
+// exceed params.time_budget or when the mean relative error of the pixels
+// is below params.target_error. The time of the next batch is predicted
+// from the last one, so the budget is overrun by at most one batch.
+// Returns the number of samples rendered so far, i.e. buf.samples[1].
+//
+// If params.adaptive is set and params.adaptive_max_samples is larger than
+// ns, the samples skipped on converged pixels are redistributed: batches
+// continue past ns on the pixels that have not converged, up to
+// params.adaptive_max_samples each, until the buffer holds as many samples
+// as ns per pixel would give, or until all pixels have converged. The
+// random sequences are then generated for params.adaptive_max_samples.
+//
+// Parameters:
+// - scn, cid, buf, ns, params: see the accum_buffer version of trace_block
+// - nthreads, block_size: see trace_image_parallel
+//
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    int nthreads = 0, int block_size = 32);
+
+//
+// Renders the image progressively with intersection routines bound at
+// compile time. See above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    const Intersect_first& intersect_first,
+                                    const Intersect_any& intersect_any,
+                                    int nthreads = 0, int block_size = 32);
+
+//
+// Renders the image progressively with path guiding. The pathtrace shader
+// samples and records radiance in guide, which is updated after each batch.
+// See init_guiding and the unguided version above.
+//
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    path_guide& guide, int nthreads = 0,
+                                    int block_size = 32);
+
+//
+// Renders the image progressively with path guiding and intersection
+// routines bound at compile time. See above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    path_guide& guide,
+                                    const Intersect_first& intersect_first,
+                                    const Intersect_any& intersect_any,
+                                    int nthreads = 0, int block_size = 32);
+
+//
+// Denoises a rendered image with an edge-avoiding a-trous wavelet filter
+// guided by the auxiliary outputs of the first hit. Albedo, normal and depth
+// are images in the format of resolve_aov. Texture detail is preserved by
+// filtering the color divided by the albedo. The filter is run in parallel
+// on image blocks.
+//
+// Parameters:
+// - img: image to denoise, overwritten with the result
+// - albedo, normal, depth: guides of the same size of img
+// - params: denoising params
+// - nthreads: number of threads (0 for hardware concurrency)
+//
+YGL_API void denoise_image(image_view<vec4f> img,
+                           const image_view<vec4f>& albedo,
+                           const image_view<vec4f>& normal,
+                           const image_view<vec4f>& depth,
+                           const denoise_params& params = {},
+                           int nthreads = 0);
+
+//
+// Denoises a rendered image with the guides stored in an accumulation buffer
+// created with aovs. See above.
+//
+YGL_API void denoise_image(image_view<vec4f> img, const accum_buffer& buf,
+                           const denoise_params& params = {},
+                           int nthreads = 0);
+
 }  // namespace
 
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION
 // -----------------------------------------------------------------------------
 
-#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// The templated functions of the interface, and the helpers they use, are
+// compiled in all modes, since templates cannot be instantiated from the
+// .cpp half. Only the definitions of the non-templated interface are
+// guarded for YGL_DECLARATION.
+//
 
+#include <array>
 #include <cassert>
 #include <cfloat>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 namespace ytrace {
 
 //
-// Compute shape element cdf for shape sampling.
+// Compute shape element alias table for shape sampling, so that elements
+// are picked in constant time. See make_alias_table.
 //
 template <typename T, typename Weight_callback>
-static inline vector<float> _compute_weight_cdf(
-    const array_view<T>& elem, float& total_weight,
-    const Weight_callback& weight_cb) {
-    // prepare return
-    auto cdf = vector<float>();
-    cdf.reserve(elem.size());
+static inline void _compute_weight_alias(const array_view<T>& elem,
+                                         vector<float>& prob,
+                                         vector<int>& alias,
+                                         float& total_weight,
+                                         const Weight_callback& weight_cb) {
+    auto n = (int)elem.size();
+    prob.resize(n);
+    alias.resize(n);
+    for (auto i = 0; i < n; i++) prob[i] = weight_cb(elem[i]);
+    total_weight = make_alias_table(prob, alias);
+}
+
+//
+// Converts an srgb color to linear, as srgb_to_linear, using a lookup table
+// to avoid calling pow for each channel.
+//
+static inline vec4f _srgb_to_linear_lut(const vec4b& srgb) {
+    static const auto lut = []() {
+        auto lut = std::array<float, 256>();
+        for (auto i = 0; i < 256; i++) lut[i] = pow(i / 255.0f, 2.2f);
+        return lut;
+    }();
+    return {lut[srgb[0]], lut[srgb[1]], lut[srgb[2]], srgb[3] / 255.0f};
+}
+
+//
+// Gets a texel of a texture as linear color.
+//
+static inline vec4f _eval_texel(const texture& txt, const vec2i& ij) {
+    if (!txt.ldr.empty()) return _srgb_to_linear_lut(txt.ldr[ij]);
+    if (!txt.hdr.empty()) return txt.hdr[ij];
+    return half_to_float(txt.hdrh[ij]);
+}
+
+//
+// Size of a texture, whichever its storage.
+//
+static inline vec2i _texture_size(const texture& txt) {
+    if (!txt.ldr.empty()) return txt.ldr.size();
+    if (!txt.hdr.empty()) return txt.hdr.size();
+    return txt.hdrh.size();
+}
+
+//
+// Builds the distribution used to sample an environment map. Texels are
+// weighted by the maximum emission they interpolate, so that every direction
+// with non-zero emission can be sampled, times the sine of their polar angle.
+// The distribution is stored as a cdf of rows and, for each row, a cdf of its
+// texels. Leaves them empty if the map has no emission.
+//
+static inline void _init_env_distribution(const scene& scn, light& light) {
+    auto& env = scn.environments[light.env_id];
+    if (env.ke_txt < 0) return;
+    auto& txt = scn.textures[env.ke_txt];
+    auto wh = _texture_size(txt);
+    if (wh[0] <= 0 || wh[1] <= 0) return;
+
+    // emission of each texel, as in _eval_envpoint
+    auto ke = vector<float>(wh[0] * wh[1]);
+    for (auto j = 0; j < wh[1]; j++) {
+        for (auto i = 0; i < wh[0]; i++) {
+            auto t = _eval_texel(txt, {i, j});
+            ke[j * wh[0] + i] = mean(lerp(env.ke, {t[0], t[1], t[2]}, t[3]));
+        }
+    }
+
+    // cdfs of texel weights
+    light.env_rows.resize(wh[1]);
+    light.env_cols.resize(wh[0] * wh[1]);
+    auto total = 0.0f;
+    for (auto j = 0; j < wh[1]; j++) {
+        auto sin_theta = sinf(pif * (j + 0.5f) / wh[1]);
+        auto row = 0.0f;
+        for (auto i = 0; i < wh[0]; i++) {
+            auto w = 0.0f;
+            for (auto dj = 0; dj < 2; dj++) {
+                for (auto di = 0; di < 2; di++) {
+                    w = max(w, ke[((j + dj) % wh[1]) * wh[0] +
+                                  (i + di) % wh[0]]);
+                }
+            }
+            row += w * sin_theta;
+            light.env_cols[j * wh[0] + i] = row;
+        }
+        for (auto i = 0; i < wh[0]; i++) {
+            auto& c = light.env_cols[j * wh[0] + i];
+            c = (row > 0) ? c / row : (i + 1) / (float)wh[0];
+        }
+        total += row;
+        light.env_rows[j] = total;
+    }
+    if (total <= 0) {
+        light.env_rows.clear();
+        light.env_cols.clear();
+        return;
+    }
+    for (auto& c : light.env_rows) c /= total;
+}
 
-    // compute weights
-    total_weight = 0;
-    for (auto&& e : elem) {
-        auto w = weight_cb(e);
-        total_weight += w;
-        cdf.push_back(total_weight);
+//
+// Union of two cones of directions. Cones are given by axis and cosine of
+// their spread. From "Importance Sampling of Many Lights with Adaptive Tree
+// Splitting" [Conty Estevez and Kulla 2018].
+//
+static inline void _union_cones(const vec3f& axis_a, float cos_a,
+                                const vec3f& axis_b, float cos_b, vec3f& axis,
+                                float& cos_o) {
+    auto theta_a = acos(clamp(cos_a, -1.0f, 1.0f));
+    auto theta_b = acos(clamp(cos_b, -1.0f, 1.0f));
+    auto theta_d = uangle(axis_a, axis_b);
+    if (min(theta_d + theta_b, pif) <= theta_a) {
+        axis = axis_a;
+        cos_o = cos_a;
+        return;
     }
+    if (min(theta_d + theta_a, pif) <= theta_b) {
+        axis = axis_b;
+        cos_o = cos_b;
+        return;
+    }
+    auto theta_o = (theta_a + theta_d + theta_b) / 2;
+    auto wr = cross(axis_a, axis_b);
+    if (theta_o >= pif || length(wr) == 0) {
+        axis = axis_a;
+        cos_o = -1;
+        return;
+    }
+    axis = normalize(rotation_mat3(wr, theta_o - theta_a) * axis_a);
+    cos_o = cos(theta_o);
+}
+
+//
+// Merges the bounds of two light tree nodes.
+//
+static inline light_node _merge_light_nodes(const light_node& a,
+                                            const light_node& b) {
+    auto node = light_node();
+    node.bbox = expand(a.bbox, b.bbox);
+    _union_cones(a.axis, a.cos_o, b.axis, b.cos_o, node.axis, node.cos_o);
+    node.cos_e = min(a.cos_e, b.cos_e);
+    node.power = a.power + b.power;
+    return node;
+}
 
-    // normalize
-    for (auto& c : cdf) c /= total_weight;
+//
+// Builds the light tree node nid over leaves [start,end) with a median split
+// along the largest axis of their centers. Children are stored next to each
+// other.
+//
+static inline void _build_light_tree(vector<light_node>& nodes, int nid,
+                                     vector<light_node>& leaves, int start,
+                                     int end) {
+    // leaf
+    if (end - start == 1) {
+        auto parent = nodes[nid].parent;
+        nodes[nid] = leaves[start];
+        nodes[nid].parent = parent;
+        return;
+    }
 
-    // done
-    return cdf;
+    // split
+    auto cbbox = invalid_bbox3f;
+    for (auto i = start; i < end; i++) cbbox += center(leaves[i].bbox);
+    auto axis = max_element(diagonal(cbbox));
+    auto mid = (start + end) / 2;
+    std::nth_element(leaves.begin() + start, leaves.begin() + mid,
+                     leaves.begin() + end,
+                     [axis](const light_node& a, const light_node& b) {
+                         return center(a.bbox)[axis] < center(b.bbox)[axis];
+                     });
+
+    // children
+    auto child = (int)nodes.size();
+    nodes.resize(nodes.size() + 2);
+    nodes[child].parent = nid;
+    nodes[child + 1].parent = nid;
+    _build_light_tree(nodes, child, leaves, start, mid);
+    _build_light_tree(nodes, child + 1, leaves, mid, end);
+
+    // bounds
+    auto parent = nodes[nid].parent;
+    nodes[nid] = _merge_light_nodes(nodes[child], nodes[child + 1]);
+    nodes[nid].parent = parent;
+    nodes[nid].child = child;
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
 // Init lights. Public API, see above.
 //
 YGL_API void init_lights(scene& scn) {
     // clear old lights
     scn._lights.resize(0);
+    scn._light_tree.resize(0);
+    scn._shape_lights.assign(scn.shapes.size(), -1);
+    scn._env_lights.resize(0);
 
     for (int sid = 0; sid < scn.shapes.size(); sid++) {
         auto& shp = scn.shapes[sid];
@@ -402,19 +1164,21 @@ YGL_API void init_lights(scene& scn) {
         auto& light = scn._lights.back();
         light.shape_id = sid;
         if (!shp.points.empty()) {
-            light.cdf = _compute_weight_cdf(shp.points, light.area,
-                                            [&shp](auto e) { return 1; });
+            _compute_weight_alias(shp.points, light.prob, light.alias,
+                                  light.area, [&shp](auto e) { return 1; });
         } else if (!shp.lines.empty()) {
-            light.cdf =
-                _compute_weight_cdf(shp.lines, light.area, [&shp](auto e) {
-                    return length(shp.pos[e[1]] - shp.pos[e[0]]);
-                });
+            _compute_weight_alias(shp.lines, light.prob, light.alias,
+                                  light.area, [&shp](auto e) {
+                                      return length(shp.pos[e[1]] -
+                                                    shp.pos[e[0]]);
+                                  });
         } else if (!shp.triangles.empty()) {
-            light.cdf =
-                _compute_weight_cdf(shp.triangles, light.area, [&shp](auto e) {
-                    return triangle_area(shp.pos[e[0]], shp.pos[e[1]],
-                                         shp.pos[e[2]]);
-                });
+            _compute_weight_alias(shp.triangles, light.prob, light.alias,
+                                  light.area, [&shp](auto e) {
+                                      return triangle_area(shp.pos[e[0]],
+                                                           shp.pos[e[1]],
+                                                           shp.pos[e[2]]);
+                                  });
         }
     }
 
@@ -424,6 +1188,68 @@ YGL_API void init_lights(scene& scn) {
         scn._lights.push_back(light());
         auto& light = scn._lights.back();
         light.env_id = envid;
+        _init_env_distribution(scn, light);
+        scn._env_lights.push_back((int)scn._lights.size() - 1);
+    }
+
+    // light tree leaves, one for each emissive point or triangle with power
+    auto leaves = vector<light_node>();
+    for (int lid = 0; lid < scn._lights.size(); lid++) {
+        auto& light = scn._lights[lid];
+        if (light.shape_id < 0) continue;
+        auto& shp = scn.shapes[light.shape_id];
+        auto ke = mean(scn.materials[shp.matid].ke);
+        scn._shape_lights[light.shape_id] = lid;
+        if (!shp.points.empty()) {
+            light.leaves.assign(shp.points.size(), -1);
+            for (auto eid = 0; eid < shp.points.size(); eid++) {
+                auto color = (shp.color.empty())
+                                 ? vec3f{1, 1, 1}
+                                 : shp.color[shp.points[eid][0]];
+                auto leaf = light_node();
+                leaf.bbox +=
+                    transform_point(shp.xform, shp.pos[shp.points[eid][0]]);
+                leaf.cos_o = -1;
+                leaf.power = 4 * pif * ke * mean(color);
+                leaf.light_id = lid;
+                leaf.elem_id = eid;
+                if (leaf.power > 0) leaves.push_back(leaf);
+            }
+        } else if (!shp.triangles.empty()) {
+            light.leaves.assign(shp.triangles.size(), -1);
+            for (auto eid = 0; eid < shp.triangles.size(); eid++) {
+                auto& t = shp.triangles[eid];
+                auto color = zero3f;
+                if (!shp.color.empty()) {
+                    for (auto i = 0; i < 3; i++) color += shp.color[t[i]] / 3;
+                } else {
+                    color = {1, 1, 1};
+                }
+                auto leaf = light_node();
+                for (auto i = 0; i < 3; i++)
+                    leaf.bbox += transform_point(shp.xform, shp.pos[t[i]]);
+                leaf.axis = normalize(transform_direction(
+                    shp.xform, triangle_normal(shp.pos[t[0]], shp.pos[t[1]],
+                                               shp.pos[t[2]])));
+                leaf.power =
+                    pif * ke * mean(color) *
+                    triangle_area(shp.pos[t[0]], shp.pos[t[1]], shp.pos[t[2]]);
+                leaf.light_id = lid;
+                leaf.elem_id = eid;
+                if (leaf.power > 0) leaves.push_back(leaf);
+            }
+        }
+    }
+
+    // build light tree
+    if (leaves.empty()) return;
+    scn._light_tree.reserve(leaves.size() * 2 - 1);
+    scn._light_tree.resize(1);
+    _build_light_tree(scn._light_tree, 0, leaves, 0, (int)leaves.size());
+    for (auto nid = 0; nid < scn._light_tree.size(); nid++) {
+        auto& node = scn._light_tree[nid];
+        if (node.child >= 0) continue;
+        scn._lights[node.light_id].leaves[node.elem_id] = nid;
     }
 }
 
@@ -443,50 +1269,551 @@ YGL_API void specular_fresnel_from_ks(const vec3f& ks, vec3f& es, vec3f& esk) {
           (1 + sqrt(ks[2])) / (1 - sqrt(ks[2]))};
     esk = zero3f;
 }
+#endif
 
-// -----------------------------------------------------------------------------
-// RANDOM NUMBER GENERATION
-// -----------------------------------------------------------------------------
+//
+// Index of texel i, j in a tiled texture level.
+//
+static inline int _tiled_index(const texture_level& lvl, int i, int j) {
+    return (((j >> 3) * lvl.ntiles + (i >> 3)) << 6) | ((j & 7) << 3) |
+           (i & 7);
+}
 
 //
-// Random number smp. Handles random number generation for stratified
-// sampling and correlated multi-jittered sampling.
+// Gets a texel of a texture level as linear color.
 //
-struct _sampler {
-    rng_pcg32 rng;   // rnumber number state
-    int i, j;        // pixel coordinates
-    int s, d;        // sample and dimension indices
-    int ns;          // number of samples
-    rng_type rtype;  // random number type
-};
+static inline vec4f _eval_texel(const texture_level& lvl, int i, int j) {
+    auto idx = _tiled_index(lvl, i, j);
+    if (!lvl.ldr.empty()) return _srgb_to_linear_lut(lvl.ldr[idx]);
+    if (!lvl.hdr.empty()) return lvl.hdr[idx];
+    return half_to_float(lvl.hdrh[idx]);
+}
 
 //
-// Initialize a smp ot type rtype for pixel i, j with ns total samples.
+// Creates an empty tiled texture level of the given size, with texels
+// stored as srgb bytes if ldr, as halfs if half or as floats otherwise.
+//
+static inline texture_level _make_texture_level(const vec2i& size, bool ldr,
+                                                bool half) {
+    auto lvl = texture_level();
+    lvl.size = size;
+    lvl.ntiles = (size[0] + 7) / 8;
+    auto ntexels = lvl.ntiles * ((size[1] + 7) / 8) * 64;
+    if (ldr)
+        lvl.ldr.resize(ntexels);
+    else if (half)
+        lvl.hdrh.resize(ntexels);
+    else
+        lvl.hdr.resize(ntexels);
+    return lvl;
+}
+
 //
-// Implementation Notes: we use hash functions to scramble the pixel ids
-// to avoid introducing unwanted correlation between pixels. These should not
-// around according to the RNG documentaion, but we still found bad cases.
-// Scrambling avoids it.
+// Sets a texel of a texture level from a linear color.
 //
-static inline _sampler _make_sampler(int i, int j, int s, int ns,
-                                     rng_type rtype) {
-    // we use various hashes to scramble the pixel values
-    _sampler smp = {{0, 0}, i, j, s, 0, ns, rtype};
-    uint64_t sample_id = ((uint64_t)(i + 1)) << 0 | ((uint64_t)(j + 1)) << 15 |
-                         ((uint64_t)(s + 1)) << 30;
-    uint64_t initseq = hash_uint64(sample_id);
-    uint64_t initstate = hash_uint64(sample_id * 3202034522624059733ull + 1ull);
-    rng_init(smp.rng, initstate, initseq);
-    return smp;
+static inline void _set_texel(texture_level& lvl, int i, int j,
+                              const vec4f& c) {
+    auto idx = _tiled_index(lvl, i, j);
+    if (!lvl.ldr.empty()) {
+        auto b = [](float v) {
+            return (unsigned char)clamp((int)(v * 255 + 0.5f), 0, 255);
+        };
+        lvl.ldr[idx] = {b(pow(c[0], 1 / 2.2f)), b(pow(c[1], 1 / 2.2f)),
+                        b(pow(c[2], 1 / 2.2f)), b(c[3])};
+    } else if (!lvl.hdrh.empty()) {
+        lvl.hdrh[idx] = float_to_half(c);
+    } else {
+        lvl.hdr[idx] = c;
+    }
 }
 
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
 //
-// Generates a 1-dimensional sample.
+// Compile scene. Public API, see above.
 //
-// Implementation Notes: For deterministic sampling (stratified and cmjs) we
-// compute a 64bit sample and use hashing to avoid correlation. Then permutation
+YGL_API void compile_scene(scene& scn) {
+    scn._compiled_shapes.resize(scn.shapes.size());
+    for (auto sid = 0; sid < scn.shapes.size(); sid++) {
+        auto& shp = scn.shapes[sid];
+        auto& cshp = scn._compiled_shapes[sid];
+
+        // elements
+        if (!shp.points.empty()) {
+            cshp.nverts = 1;
+            cshp.elems = shp.points.data()->data();
+        } else if (!shp.lines.empty()) {
+            cshp.nverts = 2;
+            cshp.elems = shp.lines.data()->data();
+        } else if (!shp.triangles.empty()) {
+            cshp.nverts = 3;
+            cshp.elems = shp.triangles.data()->data();
+        } else {
+            cshp.nverts = 0;
+            cshp.elems = nullptr;
+        }
+
+        // vertex data
+        cshp.pos.resize(shp.pos.size());
+        for (auto i = 0; i < shp.pos.size(); i++)
+            cshp.pos[i] = transform_point(shp.xform, shp.pos[i]);
+        cshp.norm.resize(shp.norm.size());
+        for (auto i = 0; i < shp.norm.size(); i++)
+            cshp.norm[i] = transform_direction(shp.xform, shp.norm[i]);
+        cshp.texcoord = shp.texcoord;
+        cshp.color = shp.color;
+
+        // material
+        auto& mat = scn.materials[shp.matid];
+        cshp.mat.ke = mat.ke;
+        cshp.mat.kd = mat.kd;
+        cshp.mat.ks = mat.ks;
+        cshp.mat.rs = mat.rs;
+        cshp.mat.use_phong = mat.use_phong;
+        cshp.mat.ke_txt = mat.ke_txt;
+        cshp.mat.kd_txt = mat.kd_txt;
+        cshp.mat.ks_txt = mat.ks_txt;
+        cshp.mat.rs_txt = mat.rs_txt;
+        cshp.mat.textured = !shp.texcoord.empty() &&
+                            (mat.ke_txt >= 0 || mat.kd_txt >= 0 ||
+                             mat.ks_txt >= 0 || mat.rs_txt >= 0);
+    }
+}
+
+//
+// Init textures. Public API, see above.
+//
+// Implementation Notes: the first level is a tiled copy of the texture.
+// Lower levels average 2x2 texels in linear space, clamping at odd sizes,
+// down to a single texel.
+//
+YGL_API void init_textures(scene& scn) {
+    for (auto& txt : scn.textures) {
+        txt._mips.clear();
+        auto size = _texture_size(txt);
+        if (size[0] <= 0 || size[1] <= 0) continue;
+        auto ldr = !txt.ldr.empty() && !txt.linear_ldr;
+        auto half = !ldr && (txt.half_mips || !txt.hdrh.empty());
+
+        // first level
+        txt._mips.push_back(_make_texture_level(size, ldr, half));
+        for (auto j = 0; j < size[1]; j++) {
+            for (auto i = 0; i < size[0]; i++) {
+                auto idx = _tiled_index(txt._mips[0], i, j);
+                if (ldr)
+                    txt._mips[0].ldr[idx] = txt.ldr[{i, j}];
+                else if (!txt.hdrh.empty() && txt.hdr.empty())
+                    txt._mips[0].hdrh[idx] = txt.hdrh[{i, j}];
+                else
+                    _set_texel(txt._mips[0], i, j, _eval_texel(txt, {i, j}));
+            }
+        }
+
+        // lower levels
+        while (size[0] > 1 || size[1] > 1) {
+            auto& prev = txt._mips.back();
+            auto lsize = vec2i{(size[0] + 1) / 2, (size[1] + 1) / 2};
+            auto lvl = _make_texture_level(lsize, ldr, half);
+            for (auto j = 0; j < lsize[1]; j++) {
+                for (auto i = 0; i < lsize[0]; i++) {
+                    auto i1 = min(2 * i + 1, size[0] - 1);
+                    auto j1 = min(2 * j + 1, size[1] - 1);
+                    auto c = (_eval_texel(prev, 2 * i, 2 * j) +
+                              _eval_texel(prev, i1, 2 * j) +
+                              _eval_texel(prev, 2 * i, j1) +
+                              _eval_texel(prev, i1, j1)) /
+                             4;
+                    _set_texel(lvl, i, j, c);
+                }
+            }
+            txt._mips.push_back(lvl);
+            size = lsize;
+        }
+    }
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// PATH GUIDING
+// -----------------------------------------------------------------------------
+
+//
+// Maps a direction to the unit square with an area-preserving cylindrical
+// mapping, so that densities differ by a factor 4 pi.
+//
+static inline vec2f _guide_dir_to_square(const vec3f& d) {
+    auto phi = atan2(d[1], d[0]);
+    if (phi < 0) phi += 2 * pif;
+    return {clamp((d[2] + 1) / 2, 0.0f, 1 - FLT_EPSILON),
+            clamp(phi / (2 * pif), 0.0f, 1 - FLT_EPSILON)};
+}
+
+//
+// Maps a point of the unit square to a direction. See above.
+//
+static inline vec3f _guide_square_to_dir(const vec2f& uv) {
+    auto cos_theta = 2 * uv[0] - 1;
+    auto sin_theta = sqrt(max(1 - cos_theta * cos_theta, 0.0f));
+    auto phi = 2 * pif * uv[1];
+    return {sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta};
+}
+
+//
+// Makes a directional tree with a single node and no energy.
+//
+static inline std::unique_ptr<guide_dtree> _make_guide_dtree() {
+    auto dtree = std::unique_ptr<guide_dtree>(new guide_dtree());
+    dtree->nodes.push_back({});
+    dtree->record.reset(new std::atomic<float>[4]());
+    return dtree;
+}
+
+//
+// Copies a directional tree together with its records.
+//
+static inline std::unique_ptr<guide_dtree> _copy_guide_dtree(
+    const guide_dtree& dtree) {
+    auto copy = std::unique_ptr<guide_dtree>(new guide_dtree());
+    copy->nodes = dtree.nodes;
+    copy->sum = dtree.sum;
+    copy->record.reset(new std::atomic<float>[dtree.nodes.size() * 4]());
+    for (auto i = 0; i < dtree.nodes.size() * 4; i++)
+        copy->record[i] = dtree.record[i].load();
+    copy->count = dtree.count.load();
+    return copy;
+}
+
+//
+// Finds the directional tree of a point in space.
+//
+static inline guide_dtree* _lookup_guide(path_guide& guide,
+                                         const vec3f& pos) {
+    auto bbox = guide.bbox;
+    auto nid = 0;
+    while (guide.nodes[nid].child >= 0) {
+        auto& node = guide.nodes[nid];
+        auto mid = (bbox[0][node.axis] + bbox[1][node.axis]) / 2;
+        if (pos[node.axis] < mid) {
+            bbox[1][node.axis] = mid;
+            nid = node.child;
+        } else {
+            bbox[0][node.axis] = mid;
+            nid = node.child + 1;
+        }
+    }
+    return guide.dtrees[guide.nodes[nid].dtree].get();
+}
+
+//
+// Picks a direction from a directional tree with energy. Random numbers are
+// reused after picking each quadrant.
+//
+static inline vec3f _sample_guide_dtree(const guide_dtree& dtree, vec2f rn) {
+    auto origin = zero2f;
+    auto size = 1.0f;
+    auto nid = 0;
+    while (true) {
+        auto& node = dtree.nodes[nid];
+        auto sum = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        auto left = (node.sum[0] + node.sum[2]) / sum;
+        auto qx = 0, qy = 0;
+        if (rn[0] < left) {
+            rn[0] = rn[0] / left;
+        } else {
+            rn[0] = (rn[0] - left) / (1 - left);
+            qx = 1;
+        }
+        auto bottom = node.sum[qx] / (node.sum[qx] + node.sum[qx + 2]);
+        if (rn[1] < bottom) {
+            rn[1] = rn[1] / bottom;
+        } else {
+            rn[1] = (rn[1] - bottom) / (1 - bottom);
+            qy = 1;
+        }
+        size /= 2;
+        origin += vec2f{(float)qx, (float)qy} * size;
+        auto q = qx + 2 * qy;
+        if (node.child[q] < 0) {
+            auto uv = origin + vec2f{min(rn[0], 1 - FLT_EPSILON),
+                                     min(rn[1], 1 - FLT_EPSILON)} *
+                                   size;
+            return _guide_square_to_dir(uv);
+        }
+        nid = node.child[q];
+    }
+}
+
+//
+// Probability density of sampling a direction from a directional tree.
+//
+static inline float _pdf_guide_dtree(const guide_dtree& dtree,
+                                     const vec3f& wi) {
+    if (dtree.sum <= 0) return 0;
+    auto uv = _guide_dir_to_square(wi);
+    auto pdf = 1 / (4 * pif);
+    auto nid = 0;
+    while (true) {
+        auto& node = dtree.nodes[nid];
+        auto qx = (uv[0] >= 0.5f) ? 1 : 0, qy = (uv[1] >= 0.5f) ? 1 : 0;
+        auto q = qx + 2 * qy;
+        auto sum = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        if (node.sum[q] <= 0) return 0;
+        pdf *= 4 * node.sum[q] / sum;
+        if (node.child[q] < 0) return pdf;
+        uv = uv * 2 - vec2f{(float)qx, (float)qy};
+        nid = node.child[q];
+    }
+}
+
+//
+// Records the radiance arriving from a direction, divided by the density
+// of the direction, in a directional tree. Thread-safe.
+//
+static inline void _record_guide_dtree(guide_dtree& dtree, const vec3f& wi,
+                                       float value) {
+    auto uv = _guide_dir_to_square(wi);
+    auto nid = 0;
+    while (true) {
+        auto& node = dtree.nodes[nid];
+        auto qx = (uv[0] >= 0.5f) ? 1 : 0, qy = (uv[1] >= 0.5f) ? 1 : 0;
+        auto q = qx + 2 * qy;
+        if (node.child[q] < 0) {
+            auto& record = dtree.record[nid * 4 + q];
+            auto old = record.load();
+            while (!record.compare_exchange_weak(old, old + value)) {
+            }
+            dtree.count++;
+            return;
+        }
+        uv = uv * 2 - vec2f{(float)qx, (float)qy};
+        nid = node.child[q];
+    }
+}
+
+//
+// Rebuilds a directional tree from the energy recorded in it. Quadrants
+// with more than a fraction of the total energy are subdivided, the others
+// are merged, and the energy of quadrants not recorded at the new
+// resolution is split evenly among their children. Trees with no energy
+// recorded keep the previous distribution. Records are cleared.
+//
+static inline void _rebuild_guide_dtree(guide_dtree& dtree) {
+    const auto split_fraction = 0.01f;
+    const auto max_depth = 20;
+
+    // sum the recorded energy up the tree; children follow their parents
+    auto& old = dtree.nodes;
+    auto energy = vector<float>(old.size() * 4);
+    for (auto i = 0; i < energy.size(); i++) energy[i] = dtree.record[i];
+    for (auto nid = (int)old.size() - 1; nid >= 0; nid--) {
+        for (auto q = 0; q < 4; q++) {
+            auto c = old[nid].child[q];
+            if (c < 0) continue;
+            energy[nid * 4 + q] = energy[c * 4 + 0] + energy[c * 4 + 1] +
+                                  energy[c * 4 + 2] + energy[c * 4 + 3];
+        }
+    }
+    auto total = energy[0] + energy[1] + energy[2] + energy[3];
+
+    // build the new tree top-down from the old one
+    if (total > 0) {
+        struct item {
+            int nid, old_nid, depth;
+            float sum;
+        };
+        auto nodes = vector<guide_dnode>(1);
+        auto stack = vector<item>{{0, 0, 0, total}};
+        while (!stack.empty()) {
+            auto cur = stack.back();
+            stack.pop_back();
+            for (auto q = 0; q < 4; q++) {
+                auto sum = (cur.old_nid >= 0) ? energy[cur.old_nid * 4 + q]
+                                              : cur.sum / 4;
+                nodes[cur.nid].sum[q] = sum;
+                if (sum / total <= split_fraction || cur.depth >= max_depth)
+                    continue;
+                auto child = (int)nodes.size();
+                nodes.push_back({});
+                nodes[cur.nid].child[q] = child;
+                auto old_child =
+                    (cur.old_nid >= 0) ? old[cur.old_nid].child[q] : -1;
+                stack.push_back({child, old_child, cur.depth + 1, sum});
+            }
+        }
+        dtree.nodes = nodes;
+        dtree.sum = total;
+    }
+
+    // clear records
+    dtree.record.reset(new std::atomic<float>[dtree.nodes.size() * 4]());
+    dtree.count = 0;
+}
+
+//
+// Updates path guiding. Spatial leaves are split until the samples recorded
+// in each are below a threshold growing with the square root of the number
+// of samples per pixel, as suggested by Muller et al., "Practical Path
+// Guiding for Efficient Light-Transport Simulation", 2017. Split leaves copy
+// their directional tree and half of the sample count to both children.
+//
+static inline void _update_guide(path_guide& guide, int ns) {
+    auto threshold = 12000 * sqrt((float)max(ns, 1));
+    for (auto nid = 0; nid < guide.nodes.size(); nid++) {
+        if (guide.nodes[nid].child >= 0) continue;
+        auto& dtree = *guide.dtrees[guide.nodes[nid].dtree];
+        if (dtree.count <= threshold) continue;
+        dtree.count = dtree.count / 2;
+        auto axis = (guide.nodes[nid].axis + 1) % 3;
+        auto child = (int)guide.nodes.size();
+        guide.nodes.push_back({axis, -1, guide.nodes[nid].dtree});
+        guide.nodes.push_back({axis, -1, (int)guide.dtrees.size()});
+        guide.dtrees.push_back(_copy_guide_dtree(dtree));
+        guide.nodes[nid].child = child;
+        guide.nodes[nid].dtree = -1;
+    }
+    for (auto& dtree : guide.dtrees) _rebuild_guide_dtree(*dtree);
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Initializes path guiding. Public API, see above.
+//
+YGL_API void init_guiding(const scene& scn, path_guide& guide) {
+    guide = path_guide();
+    for (auto& shp : scn.shapes) {
+        for (auto& p : shp.pos) guide.bbox += transform_point(shp.xform, p);
+    }
+    guide.nodes.push_back({0, -1, 0});
+    guide.dtrees.push_back(_make_guide_dtree());
+}
+
+//
+// Updates path guiding. Public API, see above.
+//
+YGL_API void update_guiding(path_guide& guide, int ns) {
+    _update_guide(guide, ns);
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// RANDOM NUMBER GENERATION
+// -----------------------------------------------------------------------------
+
+//
+// Random number smp. Handles random number generation for stratified
+// sampling and correlated multi-jittered sampling.
+//
+struct _sampler {
+    rng_pcg32 rng;   // rnumber number state
+    int i, j;        // pixel coordinates
+    int s, d;        // sample and dimension indices
+    int ns;          // number of samples
+    rng_type rtype;  // random number type
+};
+
+//
+// Initialize a smp ot type rtype for pixel i, j with ns total samples, in
+// place so that the same sampler can be reused for all samples of a thread.
+//
+// Implementation Notes: we use hash functions to scramble the pixel ids
+// to avoid introducing unwanted correlation between pixels. These should not
+// around according to the RNG documentaion, but we still found bad cases.
+// Scrambling avoids it.
+//
+// The random number generator is only seeded for the types that use it, since
+// cmjs and sobol compute all their values by hashing.
+//
+static inline void _init_sampler(_sampler& smp, int i, int j, int s, int ns,
+                                 rng_type rtype) {
+    smp.i = i;
+    smp.j = j;
+    smp.s = s;
+    smp.d = 0;
+    smp.ns = ns;
+    smp.rtype = rtype;
+    if (rtype == rng_type::cmjs || rtype == rng_type::sobol) return;
+    // we use various hashes to scramble the pixel values
+    uint64_t sample_id = ((uint64_t)(i + 1)) << 0 | ((uint64_t)(j + 1)) << 15 |
+                         ((uint64_t)(s + 1)) << 30;
+    uint64_t initseq = hash_uint64(sample_id);
+    uint64_t initstate = hash_uint64(sample_id * 3202034522624059733ull + 1ull);
+    rng_init(smp.rng, initstate, initseq);
+}
+
+//
+// Direction numbers of the first two dimensions of the Sobol sequence.
+//
+static const uint32_t _sobol_directions[2][32] = {
+    {0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000,
+     0x02000000, 0x01000000, 0x00800000, 0x00400000, 0x00200000, 0x00100000,
+     0x00080000, 0x00040000, 0x00020000, 0x00010000, 0x00008000, 0x00004000,
+     0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+     0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004,
+     0x00000002, 0x00000001},
+    {0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000,
+     0xaa000000, 0xff000000, 0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000,
+     0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000, 0x80008000, 0xc000c000,
+     0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+     0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc,
+     0xaaaaaaaa, 0xffffffff}};
+
+//
+// Evaluates dimension dim of the Sobol point of the given index.
+//
+static inline uint32_t _sobol(uint32_t index, int dim) {
+    auto x = 0u;
+    for (auto b = 0; index; b++, index >>= 1)
+        if (index & 1) x ^= _sobol_directions[dim][b];
+    return x;
+}
+
+//
+// Reverses the bits of a 32 bit integer.
+//
+static inline uint32_t _reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+//
+// Owen scrambling of a 32 bit fixed point number with the given seed.
+//
+// Implementation Notes: we use the hash of Burley, "Practical Hash-based
+// Owen Scrambling", JCGT 2020, applied to the reversed bits, so that each
+// bit is flipped depending only on the bits above it.
+//
+static inline uint32_t _owen_scramble(uint32_t x, uint32_t seed) {
+    x = _reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return _reverse_bits(x);
+}
+
+//
+// Converts a 32 bit fixed point number to a float in [0,1).
+//
+static inline float _fixed_to_float(uint32_t x) {
+    return (x >> 8) / 16777216.0f;
+}
+
+//
+// Generates a 1-dimensional sample.
+//
+// Implementation Notes: For deterministic sampling (stratified and cmjs) we
+// compute a 64bit sample and use hashing to avoid correlation. Then permutation
 // are computed with CMJS procedures.
 //
+// For Sobol sampling, we use the first two dimensions of the sequence for
+// all samples, decorrelated across pixels and dimensions by shuffling the
+// sample index and scrambling the values with per-dimension seeds. Since the
+// points do not depend on the number of samples, any prefix of the sequence
+// is well distributed, which makes it suitable for progressive rendering.
+//
 static inline float _sample_next1f(_sampler& smp) {
     float rn = 0;
     switch (smp.rtype) {
@@ -508,6 +1835,14 @@ static inline float _sample_next1f(_sampler& smp) {
             int s = hash_permute(smp.s, smp.ns, p);
             rn = (s + hash_randfloat(s, p * 0xa399d265)) / smp.ns;
         } break;
+        case rng_type::sobol: {
+            uint32_t p = hash_uint64_32(((uint64_t)(smp.i + 1)) << 0 |
+                                        ((uint64_t)(smp.j + 1)) << 15 |
+                                        ((uint64_t)(smp.d + 1)) << 30);
+            auto s = _owen_scramble(smp.s, p);
+            rn = _fixed_to_float(
+                _owen_scramble(_sobol(s, 0), p * 0xa399d265));
+        } break;
         default: assert(false);
     }
 
@@ -556,6 +1891,16 @@ static inline vec2f _sample_next2f(_sampler& smp) {
             rn[0] = (s % ns2 + (sy + jx) / ns2) / ns2;
             rn[1] = (s / ns2 + (sx + jy) / ns2) / ns2;
         } break;
+        case rng_type::sobol: {
+            uint32_t p = hash_uint64_32(((uint64_t)(smp.i + 1)) << 0 |
+                                        ((uint64_t)(smp.j + 1)) << 15 |
+                                        ((uint64_t)(smp.d + 1)) << 30);
+            auto s = _owen_scramble(smp.s, p);
+            rn[0] = _fixed_to_float(
+                _owen_scramble(_sobol(s, 0), p * 0xa399d265));
+            rn[1] = _fixed_to_float(
+                _owen_scramble(_sobol(s, 1), p * 0x711ad6a5));
+        } break;
         default: assert(false);
     }
 
@@ -586,6 +1931,13 @@ struct _point {
     // light id -----------------------------
     int light_id = -1;  // light id used for MIS
 
+    // element id ---------------------------
+    int shape_id = -1;  // shape id
+    int elem_id = -1;   // shape element id
+
+    // ray footprint ------------------------
+    float cone_width = 0;  // width of the ray cone at the point
+
     // direction ----------------------------
     vec3f wo = zero3f;  // outgoing direction
 
@@ -602,6 +1954,16 @@ struct _point {
     bool use_phong = false;  // material values
 };
 
+//
+// Ray cone used to estimate the footprint of rays for texture filtering.
+// From "Texture Level of Detail Strategies for Real-Time Ray Tracing"
+// [Akenine-Moller et al. 2019].
+//
+struct _ray_cone {
+    float width = 0;   // width at the ray origin
+    float spread = 0;  // spread angle
+};
+
 //
 // Generates a ray ray_o, ray_d from a camera cam for image plane coordinate
 // uv and the lens coordinates luv.
@@ -618,13 +1980,55 @@ static inline ray3f _eval_camera(const camera& cam, const vec2f& uv,
 }
 
 //
-// Wrapper for above function
+// Bilinear lookup in a tiled texture level.
+//
+static inline vec4f _eval_texture_level(const texture_level& lvl,
+                                        const vec2f& texcoord) {
+    // get image width/height
+    auto wh = lvl.size;
+
+    // get coordinates normalized for tiling
+    auto st = vec2f{fmod(texcoord[0], 1.0f), fmod(texcoord[1], 1.0f)} *
+              vec2f(wh[0], wh[1]);
+    if (st[0] < 0) st[0] += wh[0];
+    if (st[1] < 0) st[1] += wh[1];
+
+    // get image coordinates and residuals
+    auto ij = clamp(vec2i(st[0], st[1]), {0, 0}, wh - vec2i{1, 1});
+    auto uv = st - vec2f(ij[0], ij[1]);
+    auto ij1 = vec2i{(ij[0] + 1) % wh[0], (ij[1] + 1) % wh[1]};
+
+    // interpolate
+    return _eval_texel(lvl, ij[0], ij[1]) * ((1 - uv[0]) * (1 - uv[1])) +
+           _eval_texel(lvl, ij[0], ij1[1]) * ((1 - uv[0]) * uv[1]) +
+           _eval_texel(lvl, ij1[0], ij[1]) * (uv[0] * (1 - uv[1])) +
+           _eval_texel(lvl, ij1[0], ij1[1]) * (uv[0] * uv[1]);
+}
+
 //
-static inline vec4f _eval_texture(const texture& txt, const vec2f& texcoord) {
-    assert(!txt.hdr.empty() || !txt.ldr.empty());
+// Wrapper for above function. If the texture has mip levels, blends the
+// two levels around lod, given as log2 of the footprint in texels.
+//
+static inline vec4f _eval_texture(const texture& txt, const vec2f& texcoord,
+                                  float lod = 0) {
+    assert(!txt.hdr.empty() || !txt.ldr.empty() || !txt.hdrh.empty());
+
+    // mip-mapped lookup
+    if (!txt._mips.empty()) {
+        auto nlevels = (int)txt._mips.size();
+        if (!(lod > 0)) lod = 0;
+        if (lod > nlevels - 1) lod = (float)(nlevels - 1);
+        auto l = (int)lod;
+        auto f = lod - l;
+        auto c = _eval_texture_level(txt._mips[l], texcoord);
+        if (f > 0 && l + 1 < nlevels)
+            c = c * (1 - f) +
+                _eval_texture_level(txt._mips[l + 1], texcoord) * f;
+        return c;
+    }
 
     // get image width/height
-    auto wh = (!txt.ldr.empty()) ? txt.ldr.size() : txt.hdr.size();
+    auto wh = _texture_size(txt);
 
     // get coordinates normalized for tiling
     auto st = vec2f{fmod(texcoord[0], 1.0f), fmod(texcoord[1], 1.0f)} *
@@ -646,13 +2050,18 @@ static inline vec4f _eval_texture(const texture& txt, const vec2f& texcoord) {
 
     // handle interpolation
     if (!txt.ldr.empty()) {
-        return (srgb_to_linear(txt.ldr[idx[0]]) * w[0] +
-                srgb_to_linear(txt.ldr[idx[1]]) * w[1] +
-                srgb_to_linear(txt.ldr[idx[2]]) * w[2] +
-                srgb_to_linear(txt.ldr[idx[3]]) * w[3]);
+        return (_srgb_to_linear_lut(txt.ldr[idx[0]]) * w[0] +
+                _srgb_to_linear_lut(txt.ldr[idx[1]]) * w[1] +
+                _srgb_to_linear_lut(txt.ldr[idx[2]]) * w[2] +
+                _srgb_to_linear_lut(txt.ldr[idx[3]]) * w[3]);
     } else if (!txt.hdr.empty()) {
         return (txt.hdr[idx[0]] * w[0] + txt.hdr[idx[1]] * w[1] +
                 txt.hdr[idx[2]] * w[2] + txt.hdr[idx[3]] * w[3]);
+    } else if (!txt.hdrh.empty()) {
+        return (half_to_float(txt.hdrh[idx[0]]) * w[0] +
+                half_to_float(txt.hdrh[idx[1]]) * w[1] +
+                half_to_float(txt.hdrh[idx[2]]) * w[2] +
+                half_to_float(txt.hdrh[idx[3]]) * w[3]);
     } else {
         assert(false);
     }
@@ -1010,6 +2419,11 @@ static inline _point _eval_envpoint(const scene& scn, int env_id,
     // direction
     pt.wo = wo;
 
+    // light
+    for (auto lid : scn._env_lights) {
+        if (scn._lights[lid].env_id == env_id) pt.light_id = lid;
+    }
+
     // maerial
     pt.ke = env.ke;
 
@@ -1021,7 +2435,7 @@ static inline _point _eval_envpoint(const scene& scn, int env_id,
         auto texcoord = vec2f{phi, theta};
         if (env.ke_txt >= 0) {
             auto txt = _eval_texture(scn.textures[env.ke_txt], texcoord);
-            pt.ke = lerp({txt[0], txt[1], txt[2]}, pt.ke, txt[3]);
+            pt.ke = lerp(pt.ke, {txt[0], txt[1], txt[2]}, txt[3]);
         }
     }
 
@@ -1043,11 +2457,131 @@ static inline T _interpolate_value(const array_view<T>& vals,
     return ret;
 }
 
+//
+// Texture level of detail at a point on triangle t, without the texture size
+// term, from the ray cone width and the ratio of texture to world area.
+// Vertex positions are in world space, as the cone width, and the normal is
+// normalized since the frame of uncompiled shapes carries the scale of their
+// transform. Returns 0 if there is no cone.
+//
+static inline float _eval_texture_lod(const vec3f& p0, const vec3f& p1,
+                                      const vec3f& p2,
+                                      const array_view<vec2f>& texcoord,
+                                      const int* t, const _point& pt) {
+    if (pt.cone_width <= 0) return 0;
+    auto wa = triangle_area(p0, p1, p2);
+    auto uv1 = texcoord[t[1]] - texcoord[t[0]];
+    auto uv2 = texcoord[t[2]] - texcoord[t[0]];
+    auto ta = fabsf(uv1[0] * uv2[1] - uv1[1] * uv2[0]) / 2;
+    if (wa <= 0 || ta <= 0) return 0;
+    auto cosw = max(fabsf(dot(normalize(pt.frame[2]), pt.wo)), 0.01f);
+    return 0.5f * log2(ta / wa) + log2(pt.cone_width / cosw);
+}
+
+//
+// Applies the textures of a material to a point, at level of detail lod
+// without the texture size term.
+//
+template <typename Material>
+static inline void _eval_textures(const scene& scn, const Material& mat,
+                                  const vec2f& texcoord, float lod,
+                                  _point& pt) {
+    auto lookup = [&scn, &texcoord, lod](int txt_id) {
+        auto& txt = scn.textures[txt_id];
+        auto wh = _texture_size(txt);
+        return _eval_texture(txt, texcoord,
+                             lod + 0.5f * log2((float)wh[0] * wh[1]));
+    };
+    if (mat.ke_txt >= 0) {
+        auto txt = lookup(mat.ke_txt);
+        pt.ke = lerp(pt.ke, {txt[0], txt[1], txt[2]}, txt[3]);
+    }
+    if (mat.kd_txt >= 0) {
+        auto txt = lookup(mat.kd_txt);
+        pt.kd = lerp(pt.kd, {txt[0], txt[1], txt[2]}, txt[3]);
+    }
+    if (mat.ks_txt >= 0) {
+        auto txt = lookup(mat.ks_txt);
+        pt.ks = lerp(pt.ks, {txt[0], txt[1], txt[2]}, txt[3]);
+    }
+    if (mat.rs_txt >= 0) {
+        auto txt = lookup(mat.rs_txt);
+        pt.rs = lerp(pt.rs, txt[0], txt[3]);
+    }
+}
+
+//
+// Interpolates a value over an element of a compiled shape with N vertices.
+//
+template <int N, typename T>
+static inline T _interpolate_compiled(const vector<T>& vals, const int* elem,
+                                      const vec3f& euv) {
+    auto ret = T();
+    if (vals.empty()) return ret;
+    for (auto i = 0; i < N; i++) ret += vals[elem[i]] * euv[i];
+    return ret;
+}
+template <int N, typename T>
+static inline T _interpolate_compiled(const array_view<T>& vals,
+                                      const int* elem, const vec3f& euv) {
+    auto ret = T();
+    if (vals.empty()) return ret;
+    for (auto i = 0; i < N; i++) ret += vals[elem[i]] * euv[i];
+    return ret;
+}
+
+//
+// Fills a point on a compiled shape with N vertices per element. Vertex
+// data is already in world space and the material is stored in the shape.
+//
+template <int N>
+static inline void _eval_compiled_shapepoint(const scene& scn,
+                                             const compiled_shape& cshp,
+                                             int eid, const vec3f& euv,
+                                             _point& pt) {
+    auto elem = cshp.elems + eid * N;
+    pt.ptype = (N == 1) ? _point::type::point
+                        : ((N == 2) ? _point::type::line
+                                    : _point::type::triangle);
+
+    // frame
+    auto pos = _interpolate_compiled<N>(cshp.pos, elem, euv);
+    auto norm = _interpolate_compiled<N>(cshp.norm, elem, euv);
+    pt.frame = make_frame3(pos, norm);
+
+    // material
+    auto& mat = cshp.mat;
+    pt.ke = mat.ke;
+    pt.kd = mat.kd;
+    pt.ks = mat.ks;
+    pt.rs = mat.rs;
+    pt.use_phong = mat.use_phong;
+
+    // handle surface color
+    if (!cshp.color.empty()) {
+        auto color = _interpolate_compiled<N>(cshp.color, elem, euv);
+        pt.ke *= color;
+        pt.kd *= color;
+        pt.ks *= color;
+    }
+
+    // handle textures
+    if (mat.textured) {
+        auto texcoord = _interpolate_compiled<N>(cshp.texcoord, elem, euv);
+        auto lod = (N == 3) ? _eval_texture_lod(
+                                  cshp.pos[elem[0]], cshp.pos[elem[1]],
+                                  cshp.pos[elem[2]], cshp.texcoord, elem, pt)
+                            : 0.0f;
+        _eval_textures(scn, mat, texcoord, lod, pt);
+    }
+}
+
 //
 // Create a point for a shape. Resolves geometry and material with textures.
 //
 static inline _point _eval_shapepoint(const scene& scn, int shape_id, int eid,
-                                      const vec3f& euv, const vec3f& wo) {
+                                      const vec3f& euv, const vec3f& wo,
+                                      float cone_width = 0) {
     // set shape data
     auto pt = _point();
 
@@ -1055,8 +2589,33 @@ static inline _point _eval_shapepoint(const scene& scn, int shape_id, int eid,
     if (shape_id < 0) return pt;
     auto& shp = scn.shapes[shape_id];
 
+    // element and light
+    pt.shape_id = shape_id;
+    pt.elem_id = eid;
+    if (shape_id < scn._shape_lights.size())
+        pt.light_id = scn._shape_lights[shape_id];
+
     // direction
     pt.wo = wo;
+    pt.cone_width = cone_width;
+
+    // compiled shapes
+    if (!scn._compiled_shapes.empty()) {
+        auto& cshp = scn._compiled_shapes[shape_id];
+        switch (cshp.nverts) {
+            case 1: {
+                _eval_compiled_shapepoint<1>(scn, cshp, eid, euv, pt);
+            } break;
+            case 2: {
+                _eval_compiled_shapepoint<2>(scn, cshp, eid, euv, pt);
+            } break;
+            case 3: {
+                _eval_compiled_shapepoint<3>(scn, cshp, eid, euv, pt);
+            } break;
+            default: break;
+        }
+        return pt;
+    }
 
     // compute points and weights
     auto pos = zero3f, norm = zero3f, color = zero3f;
@@ -1107,27 +2666,75 @@ static inline _point _eval_shapepoint(const scene& scn, int shape_id, int eid,
 
     // handle textures
     if (!shp.texcoord.empty()) {
-        if (mat.ke_txt >= 0) {
-            auto txt = _eval_texture(scn.textures[mat.ke_txt], texcoord);
-            pt.ke = lerp(pt.ke, {txt[0], txt[1], txt[2]}, txt[3]);
-        }
-        if (mat.kd_txt >= 0) {
-            auto txt = _eval_texture(scn.textures[mat.kd_txt], texcoord);
-            pt.kd = lerp(pt.kd, {txt[0], txt[1], txt[2]}, txt[3]);
-        }
-        if (mat.ks_txt >= 0) {
-            auto txt = _eval_texture(scn.textures[mat.ks_txt], texcoord);
-            pt.ks = lerp(pt.ks, {txt[0], txt[1], txt[2]}, txt[3]);
-        }
-        if (mat.rs_txt >= 0) {
-            auto txt = _eval_texture(scn.textures[mat.rs_txt], texcoord);
-            pt.rs = lerp(pt.rs, txt[0], txt[3]);
+        auto lod = 0.0f;
+        if (!shp.triangles.empty()) {
+            auto& t = shp.triangles[eid];
+            lod = _eval_texture_lod(transform_point(shp.xform, shp.pos[t[0]]),
+                                    transform_point(shp.xform, shp.pos[t[1]]),
+                                    transform_point(shp.xform, shp.pos[t[2]]),
+                                    shp.texcoord, t.data(), pt);
         }
+        _eval_textures(scn, mat, texcoord, lod, pt);
     }
 
     return pt;
 }
 
+//
+// Picks a direction towards an environment map proportionally to its
+// emission, using the distribution built in init_lights.
+//
+static inline vec3f _sample_env_map(const scene& scn, const light& light,
+                                    const vec2f& rn) {
+    auto& env = scn.environments[light.env_id];
+    auto h = (int)light.env_rows.size();
+    auto w = (int)light.env_cols.size() / h;
+
+    // pick row and texel, reusing the residuals to place the direction
+    auto& rows = light.env_rows;
+    auto j =
+        (int)(std::lower_bound(rows.begin(), rows.end(), rn[1]) - rows.begin());
+    if (j > h - 1) j = h - 1;
+    auto r0 = (j) ? rows[j - 1] : 0.0f;
+    auto rv = (rows[j] > r0) ? (rn[1] - r0) / (rows[j] - r0) : 0.5f;
+    auto cols = light.env_cols.data() + j * w;
+    auto i = (int)(std::lower_bound(cols, cols + w, rn[0]) - cols);
+    if (i > w - 1) i = w - 1;
+    auto c0 = (i) ? cols[i - 1] : 0.0f;
+    auto ru = (cols[i] > c0) ? (rn[0] - c0) / (cols[i] - c0) : 0.5f;
+
+    // direction, inverting the mapping in _eval_envpoint
+    auto phi = 2 * pif * (i + clamp(ru, 0.0f, 1.0f)) / w;
+    auto theta = pif * (1 - (j + clamp(rv, 0.0f, 1.0f)) / h);
+    auto wl =
+        vec3f{cosf(phi) * sinf(theta), cosf(theta), sinf(phi) * sinf(theta)};
+    return transform_direction(env.xform, wl);
+}
+
+//
+// Probability density, in solid angle, of picking the direction wi with
+// _sample_env_map.
+//
+static inline float _pdf_env_map(const scene& scn, const light& light,
+                                 const vec3f& wi) {
+    auto& env = scn.environments[light.env_id];
+    auto h = (int)light.env_rows.size();
+    auto w = (int)light.env_cols.size() / h;
+    auto wl = transform_direction(inverse(env.xform), wi);
+    auto theta = acos(clamp(wl[1], -1.0f, 1.0f));
+    auto sin_theta = sinf(theta);
+    if (sin_theta <= 0) return 0;
+    auto u = atan2f(wl[2], wl[0]) / (2 * pif);
+    if (u < 0) u += 1;
+    auto v = 1 - theta / pif;
+    auto i = clamp((int)(u * w), 0, w - 1);
+    auto j = clamp((int)(v * h), 0, h - 1);
+    auto prow = light.env_rows[j] - ((j) ? light.env_rows[j - 1] : 0.0f);
+    auto cols = light.env_cols.data() + j * w;
+    auto pcol = cols[i] - ((i) ? cols[i - 1] : 0.0f);
+    return prow * pcol * w * h / (2 * pif * pif * sin_theta);
+}
+
 //
 // Sample weight for a light point.
 //
@@ -1135,7 +2742,10 @@ static inline float _weight_light(const scene& scn, int light_id,
                                   const _point& lpt, const _point& pt) {
     switch (lpt.ptype) {
         case _point::type::env: {
-            return 4 * pif;
+            auto& light = scn._lights[light_id];
+            if (light.env_rows.empty()) return 4 * pif;
+            auto pdf = _pdf_env_map(scn, light, -lpt.wo);
+            return (pdf) ? 1 / pdf : 0;
         } break;
         case _point::type::point: {
             auto& light = scn._lights[light_id];
@@ -1158,6 +2768,29 @@ static inline float _weight_light(const scene& scn, int light_id,
     }
 }
 
+//
+// Picks a point on the element eid of a shape light.
+//
+static inline _point _sample_light_elem(const scene& scn, int lid, int eid,
+                                        const _point& pt, const vec2f& rn) {
+    auto& light = scn._lights[lid];
+    auto& shp = scn.shapes[light.shape_id];
+    auto euv = zero3f;
+    if (!shp.triangles.empty()) {
+        euv = {sqrt(rn[0]) * (1 - rn[1]), 1 - sqrt(rn[0]), rn[1] * sqrt(rn[0])};
+    } else if (!shp.lines.empty()) {
+        euv = {1 - rn[0], rn[0], 0};
+    } else if (!shp.points.empty()) {
+        euv = {1, 0, 0};
+    } else
+        assert(false);
+
+    auto lpt = _eval_shapepoint(scn, light.shape_id, eid, euv, zero3f);
+    lpt.wo = normalize(pt.frame.o() - lpt.frame.o());
+    lpt.light_id = lid;
+    return lpt;
+}
+
 //
 // Picks a point on a light.
 //
@@ -1165,24 +2798,11 @@ static inline _point _sample_light(const scene& scn, int lid, const _point& pt,
                                    float rne, const vec2f& rn) {
     auto& light = scn._lights[lid];
     if (light.shape_id >= 0) {
-        auto& shp = scn.shapes[light.shape_id];
-        auto eid = (int)(lower_bound(light.cdf.begin(), light.cdf.end(), rne) -
-                         light.cdf.begin());
-        if (eid > light.cdf.size() - 1) eid = (int)light.cdf.size() - 1;
-
-        auto euv = zero3f;
-        if (!shp.triangles.empty()) {
-            euv = {sqrt(rn[0]) * (1 - rn[1]), 1 - sqrt(rn[0]),
-                   rn[1] * sqrt(rn[0])};
-        } else if (!shp.lines.empty()) {
-            euv = {1 - rn[0], rn[0], 0};
-        } else if (!shp.points.empty()) {
-            euv = {1, 0, 0};
-        } else
-            assert(false);
-
-        auto lpt = _eval_shapepoint(scn, light.shape_id, eid, euv, zero3f);
-        lpt.wo = normalize(pt.frame.o() - lpt.frame.o());
+        auto eid = sample_alias(light.prob, light.alias, rne);
+        return _sample_light_elem(scn, lid, eid, pt, rn);
+    } else if (light.env_id >= 0 && !light.env_rows.empty()) {
+        auto lpt = _eval_envpoint(scn, light.env_id,
+                                  -_sample_env_map(scn, light, rn));
         lpt.light_id = lid;
         return lpt;
     } else if (light.env_id >= 0) {
@@ -1200,8 +2820,143 @@ static inline _point _sample_light(const scene& scn, int lid, const _point& pt,
 }
 
 //
-// Offsets a ray origin to avoid self-intersection.
-//
+// Estimates the contribution of the emitters in a light tree node to the
+// point pt. Bounds the cosines at the emitters and at the receiver using
+// the node cones, as in "Importance Sampling of Many Lights with Adaptive
+// Tree Splitting" [Conty Estevez and Kulla 2018].
+//
+static inline float _light_importance(const light_node& node,
+                                      const _point& pt) {
+    if (node.power <= 0) return 0;
+
+    // distance to the bounds, clamped for points inside them
+    auto p = pt.frame.o();
+    auto pc = center(node.bbox);
+    auto r2 = lengthsqr(diagonal(node.bbox)) / 4;
+    auto d2 = distsqr(p, pc);
+    auto wi = (d2 > 0) ? (p - pc) / sqrt(d2) : node.axis;
+    auto theta_b = (d2 > r2) ? asin(sqrt(r2 / d2)) : pif;
+
+    // angle between the emitters normals and the point
+    auto theta = uangle(node.axis, wi) - acos(clamp(node.cos_o, -1.0f, 1.0f));
+    theta = max(theta - theta_b, 0.0f);
+    if (theta >= acos(clamp(node.cos_e, -1.0f, 1.0f))) return 0;
+    auto importance = node.power * cos(theta) / max(d2, r2);
+
+    // angle at the receiver, two-sided
+    if (pt.ptype == _point::type::triangle) {
+        auto theta_i = acos(clamp(fabsf(dot(pt.frame[2], wi)), 0.0f, 1.0f));
+        importance *= cos(max(theta_i - theta_b, 0.0f));
+    }
+
+    return importance;
+}
+
+//
+// Picks a leaf of the light tree descending from the root and choosing
+// children proportionally to their importance. Returns -1 if no light
+// contributes to pt.
+//
+static inline int _sample_light_tree(const scene& scn, const _point& pt,
+                                     float rn) {
+    if (scn._light_tree.empty()) return -1;
+    auto nid = 0;
+    while (scn._light_tree[nid].child >= 0) {
+        auto child = scn._light_tree[nid].child;
+        auto w0 = _light_importance(scn._light_tree[child], pt);
+        auto w1 = _light_importance(scn._light_tree[child + 1], pt);
+        if (w0 + w1 <= 0) return -1;
+        auto p0 = w0 / (w0 + w1);
+        if (rn < p0) {
+            nid = child;
+            rn = rn / p0;
+        } else {
+            nid = child + 1;
+            rn = (rn - p0) / (1 - p0);
+        }
+        rn = min(rn, 1 - FLT_EPSILON);
+    }
+    return nid;
+}
+
+//
+// Probability of picking the leaf nid of the light tree from pt.
+//
+static inline float _pdf_light_tree(const scene& scn, int nid,
+                                    const _point& pt) {
+    auto pdf = 1.0f;
+    while (scn._light_tree[nid].parent >= 0) {
+        auto child = scn._light_tree[scn._light_tree[nid].parent].child;
+        auto w0 = _light_importance(scn._light_tree[child], pt);
+        auto w1 = _light_importance(scn._light_tree[child + 1], pt);
+        if (w0 + w1 <= 0) return 0;
+        pdf *= ((nid == child) ? w0 : w1) / (w0 + w1);
+        nid = scn._light_tree[nid].parent;
+    }
+    return pdf;
+}
+
+//
+// Number of strategies used to pick lights in all light mode: one for each
+// environment and one for the light tree.
+//
+static inline int _num_light_strategies(const scene& scn) {
+    return (int)scn._env_lights.size() + (scn._light_tree.empty() ? 0 : 1);
+}
+
+//
+// Picks a point on any light. Chooses uniformly between the environments and
+// the light tree, then samples an element from the tree.
+//
+static inline _point _sample_lights(const scene& scn, const _point& pt,
+                                    float rnl, float rne, const vec2f& rn) {
+    auto nstrategies = _num_light_strategies(scn);
+    if (!nstrategies) return _point();
+    auto sid = min((int)(rnl * nstrategies), nstrategies - 1);
+    if (sid < scn._env_lights.size()) {
+        return _sample_light(scn, scn._env_lights[sid], pt, rne, rn);
+    }
+    auto nid = _sample_light_tree(scn, pt, rne);
+    if (nid < 0) return _point();
+    auto& leaf = scn._light_tree[nid];
+    return _sample_light_elem(scn, leaf.light_id, leaf.elem_id, pt, rn);
+}
+
+//
+// Sample weight for a light point picked with _sample_lights. Returns 0 for
+// lights that cannot be picked.
+//
+static inline float _weight_lights(const scene& scn, const _point& lpt,
+                                   const _point& pt) {
+    auto nstrategies = _num_light_strategies(scn);
+    switch (lpt.ptype) {
+        case _point::type::env: {
+            if (lpt.light_id < 0) return 0;
+            return _weight_light(scn, lpt.light_id, lpt, pt) * nstrategies;
+        } break;
+        case _point::type::point:
+        case _point::type::triangle: {
+            if (lpt.light_id < 0) return 0;
+            auto& light = scn._lights[lpt.light_id];
+            auto nid = light.leaves[lpt.elem_id];
+            if (nid < 0) return 0;
+            auto pdf = _pdf_light_tree(scn, nid, pt) / nstrategies;
+            if (!pdf) return 0;
+            auto d = dist(lpt.frame.o(), pt.frame.o());
+            if (lpt.ptype == _point::type::point) return 1 / (pdf * d * d);
+            auto& shp = scn.shapes[light.shape_id];
+            auto& t = shp.triangles[lpt.elem_id];
+            auto area =
+                triangle_area(shp.pos[t[0]], shp.pos[t[1]], shp.pos[t[2]]);
+            return area * fabsf(dot(lpt.frame[2], lpt.wo)) / (pdf * d * d);
+        } break;
+        default: return 0;
+    }
+}
+
+//
+// Offsets a ray origin to avoid self-intersection.
+//
 static inline ray3f _offset_ray(const scene& scn, const _point& pt,
                                 const vec3f& w, const render_params& params) {
     return ray3f(pt.frame.o() + pt.frame[2] * params.ray_eps, w,
@@ -1221,13 +2976,29 @@ static inline ray3f _offset_ray(const scene& scn, const _point& pt,
                  params.ray_eps, ray_dist - 2 * params.ray_eps);
 }
 
+//
+// Intersection routines used by the shaders. These are template parameters
+// so that they are resolved at compile time. The default trace_block binds
+// them to the scene callbacks.
+//
+template <typename Intersect_first, typename Intersect_any>
+struct _intersector {
+    const Intersect_first& intersect_first;  // closest hit
+    const Intersect_any& intersect_any;      // any hit
+};
+
 //
 // Intersects a ray with the scn and return the point (or env point).
 //
-static inline _point _intersect_scene(const scene& scn, const ray3f& ray) {
-    auto isec = scn.intersect_first(ray);
+template <typename Intersector>
+static inline _point _intersect_scene(const scene& scn,
+                                      const Intersector& intersector,
+                                      const ray3f& ray,
+                                      const _ray_cone& cone = {}) {
+    auto isec = intersector.intersect_first(ray);
     if (isec) {
-        return _eval_shapepoint(scn, isec.sid, isec.eid, isec.euv, -ray.d);
+        return _eval_shapepoint(scn, isec.sid, isec.eid, isec.euv, -ray.d,
+                                cone.width + cone.spread * isec.dist);
     } else if (!scn.environments.empty()) {
         return _eval_envpoint(scn, 0, -ray.d);
     } else {
@@ -1236,41 +3007,75 @@ static inline _point _intersect_scene(const scene& scn, const ray3f& ray) {
 }
 
 //
-// Evalutes direct illumination using MIS.
+// Evalutes direct illumination using MIS. If lid < 0, picks a light with
+// _sample_lights, otherwise samples light lid only.
 //
-static inline vec3f _eval_direct(const scene& scn, int lid, const _point& pt,
-                                 _sampler& smp, const render_params& params) {
+template <typename Intersector>
+static inline vec3f _eval_direct(const scene& scn,
+                                 const Intersector& intersector, int lid,
+                                 const _point& pt, _sampler& smp,
+                                 const render_params& params) {
     // select whether it goes in all light mode
     auto all_lights = (lid < 0);
 
-    // pick a light if not there
-    auto nlweight = 0.0f;
+    // sample light according to area, or with the light tree for all lights
+    auto lpt = _point();
+    auto lld = zero3f;
+    auto lweight = 0.0f;
     if (all_lights) {
-        lid = _sample_next1f(smp) * scn._lights.size();
-        if (lid > scn._lights.size() - 1) lid = (int)scn._lights.size() - 1;
-        nlweight = scn._lights.size();
+        auto rnl = _sample_next1f(smp);
+        auto rne = _sample_next1f(smp);
+        lpt = _sample_lights(scn, pt, rnl, rne, _sample_next2f(smp));
+        if (lpt.ptype != _point::type::none) {
+            lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo);
+            lweight = _weight_lights(scn, lpt, pt);
+        }
     } else {
-        nlweight = 1;
+        lpt = _sample_light(scn, lid, pt, _sample_next1f(smp),
+                            _sample_next2f(smp));
+        lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo);
+        lweight = _weight_light(scn, lid, lpt, pt);
     }
-
-    // sample light according to area
-    auto lpt =
-        _sample_light(scn, lid, pt, _sample_next1f(smp), _sample_next2f(smp));
-    auto lld = _eval_emission(lpt) * _eval_brdfcos(pt, -lpt.wo);
-    auto lweight = _weight_light(scn, lid, lpt, pt) * nlweight;
     lld *= lweight;
     if (lld != zero3f) {
         auto shadow_ray = _offset_ray(scn, pt, lpt, params);
-        if (scn.intersect_any(shadow_ray)) lld = zero3f;
+        if (intersector.intersect_any(shadow_ray)) lld = zero3f;
     }
 
     // check if mis is necessary
     if (pt.ptype == _point::type::point || pt.ptype == _point::type::line)
         return lld;
 
+    // in all light mode, the brdf is always sampled to cover all lights
+    if (all_lights) {
+        auto bwi =
+            _sample_brdfcos(pt, _sample_next1f(smp), _sample_next2f(smp));
+        auto bpt = _intersect_scene(scn, intersector,
+                                    _offset_ray(scn, pt, bwi, params));
+        auto bweight = 0.0f;
+        auto bld = zero3f;
+        if (bpt.ptype == _point::type::env ||
+            bpt.ptype == _point::type::triangle) {
+            bweight = _weight_brdfcos(pt, bwi);
+            bld = _eval_emission(bpt) * _eval_brdfcos(pt, bwi) * bweight;
+        }
+
+        // accumulate the value with mis, using pdfs since either weight
+        // may be zero; point lights can only be reached by light sampling
+        if (lld != zero3f && lpt.ptype != _point::type::point) {
+            auto bweight = _weight_brdfcos(pt, -lpt.wo);
+            auto bpdf = (bweight) ? 1 / bweight : 0.0f;
+            lld *= (1 / lweight) / ((1 / lweight) + bpdf);
+        }
+        if (bld != zero3f) {
+            auto lweight = _weight_lights(scn, bpt, pt);
+            auto lpdf = (lweight) ? 1 / lweight : 0.0f;
+            bld *= (1 / bweight) / (lpdf + (1 / bweight));
+        }
+        return lld + bld;
+    }
+
     // check if mis is necessary
-    auto& light = scn._lights[lid];
-    if (light.shape_id < 0) return lld;
     if (lpt.ptype == _point::type::point || lpt.ptype == _point::type::line) {
         return lld;
     }
@@ -1279,8 +3084,9 @@ static inline vec3f _eval_direct(const scene& scn, int lid, const _point& pt,
     auto bwi = _sample_brdfcos(pt, _sample_next1f(smp), _sample_next2f(smp));
     auto bweight = 0.0f;
     auto bld = zero3f;
-    auto bpt = _intersect_scene(scn, _offset_ray(scn, pt, bwi, params));
-    if (lid == bpt.light_id || all_lights) {
+    auto bpt =
+        _intersect_scene(scn, intersector, _offset_ray(scn, pt, bwi, params));
+    if (lid == bpt.light_id) {
         bweight = _weight_brdfcos(pt, bwi);
         bld = _eval_emission(bpt) * _eval_brdfcos(pt, bwi) * bweight;
     }
@@ -1295,7 +3101,7 @@ static inline vec3f _eval_direct(const scene& scn, int lid, const _point& pt,
         lld *= weight;
     }
     if (bld != zero3f) {
-        auto lweight = _weight_light(scn, lid, bpt, pt) * nlweight;
+        auto lweight = _weight_light(scn, lid, bpt, pt);
         // float weight =
         //     (1 / bweight) * (1 / bweight) /
         //     ((1 / lweight) * (1 / lweight) + (1 / bweight) * (1 / bweight));
@@ -1308,13 +3114,32 @@ static inline vec3f _eval_direct(const scene& scn, int lid, const _point& pt,
 }
 
 //
-// Recursive path tracing.
+// Ray cone after a bounce at pt. Approximates the spread added by the
+// material lobe with one radian for diffuse and the roughness for specular.
+//
+static inline _ray_cone _bounce_ray_cone(const _ray_cone& cone,
+                                         const _point& pt) {
+    auto wd = mean(pt.kd), ws = mean(pt.ks);
+    auto spread = (wd + ws > 0) ? (wd + ws * pt.rs) / (wd + ws) : 0.0f;
+    return {pt.cone_width, cone.spread + spread};
+}
+
+//
+// Recursive path tracing. If guide is not null, indirect rays are guided by
+// it and the radiance they carry is recorded in it.
 //
-static inline vec4f _shade_pathtrace_recd(const scene& scn, const ray3f& ray,
-                                          _sampler& smp, int ray_depth,
-                                          const render_params& params) {
+template <typename Intersector>
+static inline vec4f _shade_pathtrace_recd(const scene& scn,
+                                          const Intersector& intersector,
+                                          const ray3f& ray,
+                                          const _ray_cone& cone, _sampler& smp,
+                                          int ray_depth,
+                                          const render_params& params,
+                                          path_guide* guide,
+                                          _point* hit = nullptr) {
     // scn intersection
-    auto pt = _intersect_scene(scn, ray);
+    auto pt = _intersect_scene(scn, intersector, ray, cone);
+    if (hit) *hit = pt;
     if (pt.ptype == _point::type::none) return zero4f;
 
     // init
@@ -1329,7 +3154,7 @@ static inline vec4f _shade_pathtrace_recd(const scene& scn, const ray3f& ray,
     if (pt.kd == zero3f && pt.ks == zero3f) return la;
 
     // direct
-    l += _eval_direct(scn, 0, pt, smp, params);
+    l += _eval_direct(scn, intersector, -1, pt, smp, params);
 
     // roussian roulette
     if (ray_depth >= params.max_depth) return la;
@@ -1341,16 +3166,35 @@ static inline vec4f _shade_pathtrace_recd(const scene& scn, const ray3f& ray,
         rrweight /= wrr;
     }
 
-    // continue path
-    auto bwi = _sample_brdfcos(pt, _sample_next1f(smp), _sample_next2f(smp));
+    // continue path, with path guiding sampling either the brdf or the
+    // learned radiance and weighting them with one-sample mis
+    const auto guide_prob = 0.5f;
+    auto dtree = (guide && pt.ptype == _point::type::triangle)
+                     ? _lookup_guide(*guide, pt.frame.o())
+                     : nullptr;
+    auto guided = dtree && dtree->sum > 0;
+    auto bwi = zero3f;
+    if (guided && _sample_next1f(smp) < guide_prob) {
+        bwi = _sample_guide_dtree(*dtree, _sample_next2f(smp));
+    } else {
+        bwi = _sample_brdfcos(pt, _sample_next1f(smp), _sample_next2f(smp));
+    }
     if (bwi == zero3f) return la;
     auto bweight = _weight_brdfcos(pt, bwi);
+    if (guided) {
+        auto pdf = guide_prob * _pdf_guide_dtree(*dtree, bwi) +
+                   (1 - guide_prob) * ((bweight) ? 1 / bweight : 0);
+        bweight = (pdf) ? 1 / pdf : 0;
+    }
     if (!bweight) return la;
     auto bbrdfcos = _eval_brdfcos(pt, bwi);
     if (bbrdfcos == zero3f) return la;
-    auto ble = _shade_pathtrace_recd(scn, _offset_ray(scn, pt, bwi, params),
-                                     smp, ray_depth + 1, params);
-    l += vec3f{ble[0], ble[1], ble[2]} * bbrdfcos * rrweight;
+    auto ble = _shade_pathtrace_recd(
+        scn, intersector, _offset_ray(scn, pt, bwi, params),
+        _bounce_ray_cone(cone, pt), smp, ray_depth + 1, params, guide);
+    auto li = vec3f{ble[0], ble[1], ble[2]};
+    l += li * bbrdfcos * bweight * rrweight;
+    if (dtree) _record_guide_dtree(*dtree, bwi, mean(li) * bweight);
 
     return la;
 }
@@ -1358,19 +3202,28 @@ static inline vec4f _shade_pathtrace_recd(const scene& scn, const ray3f& ray,
 //
 // Shader interface for the above function.
 //
-static inline vec4f _shade_pathtrace(const scene& scn, const ray3f& ray,
-                                     _sampler& smp,
-                                     const render_params& params) {
-    return _shade_pathtrace_recd(scn, ray, smp, 0, params);
+template <typename Intersector>
+static inline vec4f _shade_pathtrace(const scene& scn,
+                                     const Intersector& intersector,
+                                     const ray3f& ray, const _ray_cone& cone,
+                                     _sampler& smp, const render_params& params,
+                                     path_guide* guide, _point* hit = nullptr) {
+    return _shade_pathtrace_recd(scn, intersector, ray, cone, smp, 0, params,
+                                 guide, hit);
 }
 
 //
 // Direct illuination.
 //
-static inline vec4f _shade_direct(const scene& scn, const ray3f& ray,
-                                  _sampler& smp, const render_params& params) {
+template <typename Intersector>
+static inline vec4f _shade_direct(const scene& scn,
+                                  const Intersector& intersector,
+                                  const ray3f& ray, const _ray_cone& cone,
+                                  _sampler& smp, const render_params& params,
+                                  _point* hit = nullptr) {
     // scn intersection
-    auto pt = _intersect_scene(scn, ray);
+    auto pt = _intersect_scene(scn, intersector, ray, cone);
+    if (hit) *hit = pt;
     if (pt.ptype == _point::type::none) return zero4f;
 
     // init
@@ -1387,9 +3240,17 @@ static inline vec4f _shade_direct(const scene& scn, const ray3f& ray,
     // ambient
     l += params.amb * pt.kd;
 
-    // direct
-    for (int lid = 0; lid < scn._lights.size(); lid++) {
-        l += _eval_direct(scn, lid, pt, smp, params);
+    // direct, either looping over all lights or averaging a few estimates
+    // that each pick a light with the light tree
+    auto nlights = params.direct_lights;
+    if (nlights > 0 && nlights < scn._lights.size()) {
+        for (auto k = 0; k < nlights; k++) {
+            l += _eval_direct(scn, intersector, -1, pt, smp, params) / nlights;
+        }
+    } else {
+        for (int lid = 0; lid < scn._lights.size(); lid++) {
+            l += _eval_direct(scn, intersector, lid, pt, smp, params);
+        }
     }
 
     // done
@@ -1399,11 +3260,15 @@ static inline vec4f _shade_direct(const scene& scn, const ray3f& ray,
 //
 // Eyelight for quick previewing.
 //
-static inline vec4f _shade_eyelight(const scene& scn, const ray3f& ray,
-                                    _sampler& smp,
-                                    const render_params& params) {
+template <typename Intersector>
+static inline vec4f _shade_eyelight(const scene& scn,
+                                    const Intersector& intersector,
+                                    const ray3f& ray, const _ray_cone& cone,
+                                    _sampler& smp, const render_params& params,
+                                    _point* hit = nullptr) {
     // intersection
-    _point pt = _intersect_scene(scn, ray);
+    _point pt = _intersect_scene(scn, intersector, ray, cone);
+    if (hit) *hit = pt;
     if (pt.ptype == _point::type::none) return zero4f;
 
     // init
@@ -1421,44 +3286,118 @@ static inline vec4f _shade_eyelight(const scene& scn, const ray3f& ray,
 }
 
 //
-// Shader function callback.
+// Shades a camera ray. The shader type is a template parameter so that the
+// switch is resolved at compile time in the block loop below. The guide is
+// used only by the path tracer.
 //
-using shade_fn = function<vec4f(const scene& scn, const ray3f& ray,
-                                _sampler& smp, const render_params& params)>;
+template <shader_type stype, typename Intersector>
+static inline vec4f _shade(const scene& scn, const Intersector& intersector,
+                           const ray3f& ray, const _ray_cone& cone,
+                           _sampler& smp, const render_params& params,
+                           path_guide* guide, _point* hit = nullptr) {
+    switch (stype) {
+        case shader_type::eyelight:
+            return _shade_eyelight(scn, intersector, ray, cone, smp, params,
+                                   hit);
+        case shader_type::def:
+        case shader_type::direct:
+            return _shade_direct(scn, intersector, ray, cone, smp, params,
+                                 hit);
+        case shader_type::pathtrace:
+            return _shade_pathtrace(scn, intersector, ray, cone, smp, params,
+                                    guide, hit);
+        default: assert(false); return zero4f;
+    }
+}
 
 //
-// Renders a block of pixels. Public API, see above.
+// Properties of the first hit of a sample, for auxiliary outputs.
 //
-YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
-                         int ns, const vec2i& xy, const vec2i& wh,
-                         const vec2i& samples, const render_params& params,
-                         bool accumulate) {
-    auto& cam = scn.cameras[cid];
-    shade_fn shade;
-    switch (params.stype) {
-        case shader_type::eyelight: shade = _shade_eyelight; break;
-        case shader_type::def:
-        case shader_type::direct: shade = _shade_direct; break;
-        case shader_type::pathtrace: shade = _shade_pathtrace; break;
-        default: assert(false); return;
+struct _aov_sample {
+    vec3f albedo = zero3f;  // albedo, or emission for the environment
+    vec3f normal = zero3f;  // world-space normal
+    float depth = 0;        // distance from the camera
+    int shape_id = -1;      // shape id
+    int material_id = -1;   // material id
+};
+
+//
+// Scratch state of a rendering thread, created once per thread, or once per
+// block by the public block functions, and reused for all the samples it
+// traces. Samplers are reset in place, so that nothing is allocated or
+// initialized per sample.
+//
+struct _render_context {
+    _sampler smp;                 // sampler of the current sample
+    _point hit;                   // first hit of the current sample
+    path_guide* guide = nullptr;  // guide of guided renders
+};
+
+//
+// Computes one sample of pixel ij, with clamping, using the scratch state of
+// ctx. Non-finite samples are returned as zero. If aov is not null, it is
+// filled from the first hit.
+//
+template <shader_type stype, typename Intersector>
+static inline vec4f _trace_sample(const scene& scn,
+                                  const Intersector& intersector,
+                                  const camera& cam, const vec2i& size,
+                                  const vec2i& ij, int s, int ns,
+                                  const render_params& params,
+                                  _render_context& ctx,
+                                  _aov_sample* aov = nullptr) {
+    auto& smp = ctx.smp;
+    _init_sampler(smp, ij[0], ij[1], s, ns, params.rtype);
+    auto rn = _sample_next2f(smp);
+    auto uv =
+        vec2f{(ij[0] + rn[0]) / size[0], 1 - (ij[1] + rn[1]) / size[1]};
+    auto ray = _eval_camera(cam, uv, _sample_next2f(smp));
+    auto cone = _ray_cone();
+    cone.spread = 2 * tan(cam.yfov / 2) / size[1];
+    auto& hit = ctx.hit;
+    auto l = _shade<stype>(scn, intersector, ray, cone, smp, params,
+                           ctx.guide, (aov) ? &hit : nullptr);
+    if (aov) {
+        *aov = _aov_sample();
+        if (hit.ptype == _point::type::env) {
+            aov->albedo = hit.ke;
+        } else if (hit.ptype != _point::type::none) {
+            aov->albedo = clamp(hit.kd + hit.ks, 0.0f, 1.0f);
+            aov->normal = hit.frame[2];
+            aov->depth = dist(ray.o, hit.frame.o());
+            aov->shape_id = hit.shape_id;
+            aov->material_id = scn.shapes[hit.shape_id].matid;
+        }
     }
+    if (!std::isfinite(l[0]) || !std::isfinite(l[1]) || !std::isfinite(l[2]))
+        return zero4f;
+    if (params.pixel_clamp > 0)
+        *(vec3f*)&l = clamplen(*(vec3f*)&l, params.pixel_clamp);
+    return l;
+}
+
+//
+// Renders a block of pixels with a fixed shader. The pixels of img are the
+// rows of an image of the given size starting at row.
+//
+template <shader_type stype, typename Intersector>
+static inline void _trace_block(const scene& scn,
+                                const Intersector& intersector, int cid,
+                                image_view<vec4f> img, const vec2i& size,
+                                int row, int ns, const vec2i& xy,
+                                const vec2i& wh, const vec2i& samples,
+                                const render_params& params,
+                                _render_context& ctx, bool accumulate) {
+    auto& cam = scn.cameras[cid];
     for (auto j = xy[1]; j < xy[1] + wh[1]; j++) {
         for (auto i = xy[0]; i < xy[0] + wh[0]; i++) {
             auto ij = vec2i(i, j);
             auto saved = img[ij];
             img[ij] = zero4f;
             for (auto s = samples[0]; s < samples[1]; s++) {
-                auto smp = _make_sampler(i, j, s, ns, params.rtype);
-                auto rn = _sample_next2f(smp);
-                auto uv = vec2f{(i + rn[0]) / img.size()[0],
-                                1 - (j + rn[1]) / img.size()[1]};
-                auto ray = _eval_camera(cam, uv, _sample_next2f(smp));
-                auto l = shade(scn, ray, smp, params);
-                if (!isfinite(l[0]) || !isfinite(l[1]) || !isfinite(l[2]))
-                    continue;
-                if (params.pixel_clamp > 0)
-                    *(vec3f*)&l = clamplen(*(vec3f*)&l, params.pixel_clamp);
-                img[ij] += l;
+                img[ij] += _trace_sample<stype>(scn, intersector, cam, size,
+                                                {i, j + row}, s, ns, params,
+                                                ctx);
             }
             if (accumulate && samples[0]) {
                 img[ij] += saved * samples[0];
@@ -1470,6 +3409,479 @@ YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
     }
 }
 
+//
+// Renders a block of the rows of an image starting at row, choosing the
+// shader at runtime.
+//
+template <typename Intersect_first, typename Intersect_any>
+static inline void _trace_strip_block(
+    const scene& scn, int cid, image_view<vec4f> img, const vec2i& size,
+    int row, int ns, const vec2i& xy, const vec2i& wh, const vec2i& samples,
+    const render_params& params, const Intersect_first& intersect_first,
+    const Intersect_any& intersect_any, _render_context& ctx,
+    bool accumulate) {
+    auto intersector = _intersector<Intersect_first, Intersect_any>{
+        intersect_first, intersect_any};
+    switch (params.stype) {
+        case shader_type::eyelight:
+            _trace_block<shader_type::eyelight>(scn, intersector, cid, img,
+                                                size, row, ns, xy, wh, samples,
+                                                params, ctx, accumulate);
+            break;
+        case shader_type::def:
+        case shader_type::direct:
+            _trace_block<shader_type::direct>(scn, intersector, cid, img, size,
+                                              row, ns, xy, wh, samples, params,
+                                              ctx, accumulate);
+            break;
+        case shader_type::pathtrace:
+            _trace_block<shader_type::pathtrace>(scn, intersector, cid, img,
+                                                 size, row, ns, xy, wh,
+                                                 samples, params, ctx,
+                                                 accumulate);
+            break;
+        default: assert(false); return;
+    }
+}
+
+//
+// Renders a block of pixels with static intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
+                         int ns, const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params,
+                         const Intersect_first& intersect_first,
+                         const Intersect_any& intersect_any, bool accumulate) {
+    auto ctx = _render_context();
+    _trace_strip_block(scn, cid, img, img.size(), 0, ns, xy, wh, samples,
+                       params, intersect_first, intersect_any, ctx, accumulate);
+}
+
+//
+// Convergence test on the accumulated values of a pixel.
+//
+// Implementation Notes: we compare the standard error of the mean luminance
+// to the luminance itself, clamped from below to avoid sampling forever
+// pixels that are almost black.
+//
+static inline bool _is_pixel_converged(const vec4f& sum, float sum2, int n,
+                                       const render_params& params) {
+    if (n < max(params.adaptive_min_samples, 2)) return false;
+    auto mu = mean(vec3f{sum[0], sum[1], sum[2]}) / n;
+    auto var = max((sum2 / n - mu * mu) * n / (n - 1), 0.0f);
+    return sqrt(var / n) <= params.adaptive_error * max(mu, 0.01f);
+}
+
+//
+// Renders a block of pixels into an accumulation buffer with a fixed shader.
+//
+// Implementation Notes: the samples of each pixel are summed locally and
+// added to the buffer once per call. The buffer then holds the sum of the
+// per-call sums in call order, which is what merging partial buffers
+// rendered one call each reproduces.
+//
+template <shader_type stype, typename Intersector>
+static inline void _trace_block(const scene& scn,
+                                const Intersector& intersector, int cid,
+                                accum_buffer& buf, int ns, const vec2i& xy,
+                                const vec2i& wh, const vec2i& samples,
+                                const render_params& params,
+                                _render_context& ctx) {
+    auto& cam = scn.cameras[cid];
+    auto aovs = !buf.ids.empty();
+    for (auto j = xy[1]; j < xy[1] + wh[1]; j++) {
+        for (auto i = xy[0]; i < xy[0] + wh[0]; i++) {
+            auto ij = vec2i(i, j);
+            auto sum = zero4f;
+            auto sum2 = 0.0f;
+            auto count = 0;
+            auto albedo = zero3f, normal = zero3f;
+            auto depth = 0.0f;
+            for (auto s = samples[0]; s < samples[1]; s++) {
+                if (params.adaptive &&
+                    _is_pixel_converged(buf.sum[ij] + sum, buf.sum2[ij] + sum2,
+                                        buf.count[ij] + count, params))
+                    break;
+                auto aov = _aov_sample();
+                auto l = _trace_sample<stype>(scn, intersector, cam,
+                                              buf.sum.size(), ij, s, ns, params,
+                                              ctx, (aovs) ? &aov : nullptr);
+                auto lum = mean(vec3f{l[0], l[1], l[2]});
+                sum += l;
+                sum2 += lum * lum;
+                if (aovs) {
+                    albedo += aov.albedo;
+                    normal += aov.normal;
+                    depth += aov.depth;
+                    if (!buf.count[ij] && !count)
+                        buf.ids[ij] = {aov.shape_id, aov.material_id};
+                }
+                count += 1;
+            }
+            if (!count) continue;
+            buf.sum[ij] += sum;
+            buf.sum2[ij] += sum2;
+            if (aovs) {
+                buf.albedo[ij] += albedo;
+                buf.normal[ij] += normal;
+                buf.depth[ij] += depth;
+            }
+            buf.count[ij] += count;
+        }
+    }
+}
+
+//
+// Renders a block of pixels into an accumulation buffer, choosing the shader
+// at runtime.
+//
+template <typename Intersect_first, typename Intersect_any>
+static inline void _trace_accum_block(const scene& scn, int cid,
+                                      accum_buffer& buf, int ns,
+                                      const vec2i& xy, const vec2i& wh,
+                                      const vec2i& samples,
+                                      const render_params& params,
+                                      const Intersect_first& intersect_first,
+                                      const Intersect_any& intersect_any,
+                                      _render_context& ctx) {
+    auto intersector = _intersector<Intersect_first, Intersect_any>{
+        intersect_first, intersect_any};
+    switch (params.stype) {
+        case shader_type::eyelight:
+            _trace_block<shader_type::eyelight>(scn, intersector, cid, buf, ns,
+                                                xy, wh, samples, params, ctx);
+            break;
+        case shader_type::def:
+        case shader_type::direct:
+            _trace_block<shader_type::direct>(scn, intersector, cid, buf, ns,
+                                              xy, wh, samples, params, ctx);
+            break;
+        case shader_type::pathtrace:
+            _trace_block<shader_type::pathtrace>(scn, intersector, cid, buf, ns,
+                                                 xy, wh, samples, params, ctx);
+            break;
+        default: assert(false); return;
+    }
+}
+
+//
+// Renders a block of pixels into an accumulation buffer with static
+// intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_block(const scene& scn, int cid, accum_buffer& buf, int ns,
+                         const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params,
+                         const Intersect_first& intersect_first,
+                         const Intersect_any& intersect_any) {
+    auto ctx = _render_context();
+    _trace_accum_block(scn, cid, buf, ns, xy, wh, samples, params,
+                       intersect_first, intersect_any, ctx);
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Renders a block of pixels into an accumulation buffer. Public API, see
+// above.
+//
+YGL_API void trace_block(const scene& scn, int cid, accum_buffer& buf, int ns,
+                         const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params) {
+    trace_block(scn, cid, buf, ns, xy, wh, samples, params, scn.intersect_first,
+                scn.intersect_any);
+}
+
+//
+// Creates an accumulation buffer. Public API, see above.
+//
+YGL_API accum_buffer make_accum_buffer(const vec2i& size, bool aovs) {
+    auto buf = accum_buffer();
+    buf.sum = image<vec4f>(size, zero4f);
+    buf.sum2 = image<float>(size, 0.0f);
+    buf.count = image<int>(size, 0);
+    if (aovs) {
+        buf.albedo = image<vec3f>(size, zero3f);
+        buf.normal = image<vec3f>(size, zero3f);
+        buf.depth = image<float>(size, 0.0f);
+        buf.ids = image<vec2i>(size, {-1, -1});
+    }
+    return buf;
+}
+
+//
+// Resolves an accumulation buffer. Public API, see above.
+//
+YGL_API void resolve_block(const accum_buffer& buf, image_view<vec4f> img,
+                           const vec2i& xy, const vec2i& wh) {
+    assert(buf.sum.size() == img.size());
+    auto wh_ = vec2i{(wh[0] < 0) ? img.size()[0] - xy[0] : wh[0],
+                     (wh[1] < 0) ? img.size()[1] - xy[1] : wh[1]};
+    for (auto j = xy[1]; j < xy[1] + wh_[1]; j++) {
+        for (auto i = xy[0]; i < xy[0] + wh_[0]; i++) {
+            auto ij = vec2i(i, j);
+            img[ij] = (buf.count[ij]) ? buf.sum[ij] / buf.count[ij] : zero4f;
+        }
+    }
+}
+
+//
+// Resolves the buffer as halfs. Public API, see above.
+//
+YGL_API void resolve_block(const accum_buffer& buf, image_view<vec4h> img,
+                           const vec2i& xy, const vec2i& wh) {
+    assert(buf.sum.size() == img.size());
+    auto wh_ = vec2i{(wh[0] < 0) ? img.size()[0] - xy[0] : wh[0],
+                     (wh[1] < 0) ? img.size()[1] - xy[1] : wh[1]};
+    for (auto j = xy[1]; j < xy[1] + wh_[1]; j++) {
+        for (auto i = xy[0]; i < xy[0] + wh_[0]; i++) {
+            auto ij = vec2i(i, j);
+            img[ij] = float_to_half(
+                (buf.count[ij]) ? buf.sum[ij] / buf.count[ij] : zero4f);
+        }
+    }
+}
+
+//
+// Resolves an auxiliary output. Public API, see above.
+//
+YGL_API void resolve_aov(const accum_buffer& buf, aov_type type,
+                         image_view<vec4f> img, const vec2i& xy,
+                         const vec2i& wh) {
+    assert(buf.sum.size() == img.size());
+    auto wh_ = vec2i{(wh[0] < 0) ? img.size()[0] - xy[0] : wh[0],
+                     (wh[1] < 0) ? img.size()[1] - xy[1] : wh[1]};
+    for (auto j = xy[1]; j < xy[1] + wh_[1]; j++) {
+        for (auto i = xy[0]; i < xy[0] + wh_[0]; i++) {
+            auto ij = vec2i(i, j);
+            auto n = buf.count[ij];
+            auto v = zero3f;
+            switch (type) {
+                case aov_type::albedo: {
+                    if (n) v = buf.albedo[ij] / n;
+                } break;
+                case aov_type::normal: {
+                    if (n && buf.normal[ij] != zero3f)
+                        v = normalize(buf.normal[ij]);
+                } break;
+                case aov_type::depth: {
+                    if (n) v[0] = buf.depth[ij] / n;
+                } break;
+                case aov_type::shape_id: {
+                    v[0] = buf.ids[ij][0];
+                } break;
+                case aov_type::material_id: {
+                    v[0] = buf.ids[ij][1];
+                } break;
+                case aov_type::variance: {
+                    if (n > 1) {
+                        auto& sum = buf.sum[ij];
+                        auto mu = mean(vec3f{sum[0], sum[1], sum[2]}) / n;
+                        v[0] = max((buf.sum2[ij] / n - mu * mu) * n / (n - 1),
+                                   0.0f);
+                    }
+                } break;
+                case aov_type::samples: {
+                    v[0] = n;
+                } break;
+                default: assert(false);
+            }
+            img[ij] = {v[0], v[1], v[2], 1};
+        }
+    }
+}
+#endif
+
+//
+// Header of accumulation buffer checkpoints.
+//
+struct _accum_buffer_header {
+    char magic[4] = {'y', 't', 'a', 'b'};  // file identifier
+    int version = 2;                       // format version
+    vec2i size = {0, 0};                   // image size
+    vec2i samples = {0, 0};                // range of sample indices traced
+    int aovs = 0;                          // whether aovs are stored
+    int ns = 0;                            // samples of the random sequences
+    int rtype = 0;                         // random type
+    int stype = 0;                         // shader type
+};
+
+//
+// Writes image data to a checkpoint file.
+//
+template <typename T>
+static inline bool _fwrite_image(FILE* f, const image<T>& img) {
+    auto num = (size_t)img.size()[0] * (size_t)img.size()[1];
+    return fwrite(img.data(), sizeof(T), num, f) == num;
+}
+
+//
+// Reads image data from a checkpoint file.
+//
+template <typename T>
+static inline bool _fread_image(FILE* f, image<T>& img, const vec2i& size) {
+    img = image<T>(size);
+    auto num = (size_t)size[0] * (size_t)size[1];
+    return fread(img.data(), sizeof(T), num, f) == num;
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Saves an accumulation buffer. Public API, see above.
+//
+// Implementation Notes: the data is first written to a temporary file that
+// is then renamed, so that a job killed while saving leaves the previous
+// checkpoint intact.
+//
+YGL_API bool save_accum_buffer(const std::string& filename,
+                               const accum_buffer& buf, std::string& errmsg) {
+    auto tmpname = filename + ".tmp";
+    auto f = fopen(tmpname.c_str(), "wb");
+    if (!f) {
+        errmsg = "could not write checkpoint file";
+        return false;
+    }
+    auto header = _accum_buffer_header();
+    header.size = buf.sum.size();
+    header.samples = buf.samples;
+    header.aovs = !buf.ids.empty();
+    header.ns = buf.ns;
+    header.rtype = (int)buf.rtype;
+    header.stype = (int)buf.stype;
+    auto ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              _fwrite_image(f, buf.sum) && _fwrite_image(f, buf.sum2) &&
+              _fwrite_image(f, buf.count);
+    if (ok && header.aovs) {
+        ok = _fwrite_image(f, buf.albedo) && _fwrite_image(f, buf.normal) &&
+             _fwrite_image(f, buf.depth) && _fwrite_image(f, buf.ids);
+    }
+    fclose(f);
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    if (ok) remove(filename.c_str());
+#endif
+    if (!ok || rename(tmpname.c_str(), filename.c_str())) {
+        errmsg = "could not write checkpoint file";
+        return false;
+    }
+    return true;
+}
+
+//
+// Loads an accumulation buffer. Public API, see above.
+//
+YGL_API bool load_accum_buffer(const std::string& filename, accum_buffer& buf,
+                               std::string& errmsg) {
+    auto f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        errmsg = "could not read checkpoint file";
+        return false;
+    }
+    auto header = _accum_buffer_header();
+    auto ok = fread(&header, sizeof(header), 1, f) == 1;
+    if (!ok || strncmp(header.magic, "ytab", 4) || header.version != 2 ||
+        header.size[0] <= 0 || header.size[1] <= 0) {
+        fclose(f);
+        errmsg = "invalid checkpoint file";
+        return false;
+    }
+    // check the size against the rest of the file before allocating it
+    auto pos = ftell(f);
+    auto remaining = (fseek(f, 0, SEEK_END)) ? -1.0 : (double)(ftell(f) - pos);
+    auto pixel_bytes = sizeof(vec4f) + sizeof(float) + sizeof(int);
+    if (header.aovs)
+        pixel_bytes += 2 * sizeof(vec3f) + sizeof(float) + sizeof(vec2i);
+    if (pos < 0 || fseek(f, pos, SEEK_SET) ||
+        (double)header.size[0] * (double)header.size[1] * pixel_bytes >
+            remaining) {
+        fclose(f);
+        errmsg = "invalid checkpoint file";
+        return false;
+    }
+    buf = make_accum_buffer(header.size, header.aovs);
+    buf.samples = header.samples;
+    buf.ns = header.ns;
+    buf.rtype = (rng_type)header.rtype;
+    buf.stype = (shader_type)header.stype;
+    ok = _fread_image(f, buf.sum, header.size) &&
+         _fread_image(f, buf.sum2, header.size) &&
+         _fread_image(f, buf.count, header.size);
+    if (ok && header.aovs) {
+        ok = _fread_image(f, buf.albedo, header.size) &&
+             _fread_image(f, buf.normal, header.size) &&
+             _fread_image(f, buf.depth, header.size) &&
+             _fread_image(f, buf.ids, header.size);
+    }
+    fclose(f);
+    if (!ok) {
+        errmsg = "truncated checkpoint file";
+        return false;
+    }
+    return true;
+}
+
+//
+// Merges accumulation buffers. Public API, see above.
+//
+YGL_API bool merge_accum_buffers(accum_buffer& buf, const accum_buffer& other,
+                                 std::string& errmsg) {
+    if (buf.sum.empty()) {
+        buf = other;
+        return true;
+    }
+    if (buf.sum.size() != other.sum.size() ||
+        buf.ids.empty() != other.ids.empty()) {
+        errmsg = "accumulation buffers do not match";
+        return false;
+    }
+    if (buf.ns != other.ns || buf.rtype != other.rtype ||
+        buf.stype != other.stype) {
+        errmsg = "accumulation buffers were rendered with different settings";
+        return false;
+    }
+    if (buf.samples[1] != other.samples[0]) {
+        errmsg = "accumulation buffers sample ranges are not contiguous";
+        return false;
+    }
+    auto size = buf.sum.size();
+    for (auto j = 0; j < size[1]; j++) {
+        for (auto i = 0; i < size[0]; i++) {
+            auto ij = vec2i{i, j};
+            buf.sum[ij] += other.sum[ij];
+            buf.sum2[ij] += other.sum2[ij];
+            if (!buf.ids.empty()) {
+                buf.albedo[ij] += other.albedo[ij];
+                buf.normal[ij] += other.normal[ij];
+                buf.depth[ij] += other.depth[ij];
+                if (!buf.count[ij]) buf.ids[ij] = other.ids[ij];
+            }
+            buf.count[ij] += other.count[ij];
+        }
+    }
+    buf.samples[1] = other.samples[1];
+    return true;
+}
+
+//
+// Pixel convergence test. Public API, see above.
+//
+YGL_API bool is_pixel_converged(const accum_buffer& buf, const vec2i& ij,
+                                const render_params& params) {
+    return _is_pixel_converged(buf.sum[ij], buf.sum2[ij], buf.count[ij],
+                               params);
+}
+
+//
+// Renders a block of pixels. Public API, see above.
+//
+YGL_API void trace_block(const scene& scn, int cid, image_view<vec4f> img,
+                         int ns, const vec2i& xy, const vec2i& wh,
+                         const vec2i& samples, const render_params& params,
+                         bool accumulate) {
+    trace_block(scn, cid, img, ns, xy, wh, samples, params, scn.intersect_first,
+                scn.intersect_any, accumulate);
+}
+
 //
 // Renders the whole image. Public API, see above.
 //
@@ -1477,9 +3889,630 @@ YGL_API void trace_image(const scene& scn, int cid, image_view<vec4f> img,
                          int ns, const render_params& params) {
     trace_block(scn, cid, img, ns, {0, 0}, img.size(), {0, ns}, params);
 }
+#endif
 
-}  // namespace
+// -----------------------------------------------------------------------------
+// PARALLEL RENDERING
+// -----------------------------------------------------------------------------
+
+//
+// Index of the cell (x, y) along the Hilbert curve filling a n x n grid,
+// with n a power of two.
+//
+static inline int _hilbert_index(int n, int x, int y) {
+    auto d = 0;
+    for (auto s = n / 2; s > 0; s /= 2) {
+        auto rx = ((x & s) > 0) ? 1 : 0, ry = ((y & s) > 0) ? 1 : 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (!ry) {
+            if (rx) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
 
+//
+// Image blocks sorted along a Hilbert curve to keep neighboring blocks, and
+// the scene data they touch, close in time.
+//
+static inline vector<pair<vec2i, vec2i>> _make_hilbert_blocks(
+    const vec2i& size, int block_size) {
+    auto nblocks = vec2i{(size[0] + block_size - 1) / block_size,
+                         (size[1] + block_size - 1) / block_size};
+    auto n = 1;
+    while (n < nblocks[0] || n < nblocks[1]) n *= 2;
+    auto keys = vector<pair<int, int>>();
+    for (auto bj = 0; bj < nblocks[1]; bj++) {
+        for (auto bi = 0; bi < nblocks[0]; bi++) {
+            keys.push_back({_hilbert_index(n, bi, bj), bj * nblocks[0] + bi});
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    auto blocks = vector<pair<vec2i, vec2i>>();
+    for (auto& key : keys) {
+        auto xy = vec2i{key.second % nblocks[0], key.second / nblocks[0]} *
+                  block_size;
+        blocks.push_back({xy, {min(block_size, size[0] - xy[0]),
+                               min(block_size, size[1] - xy[1])}});
+    }
+    return blocks;
+}
+
+//
+// Per-thread block queue. The owner pops from the front, thieves from the
+// back, so that each side keeps walking a contiguous piece of the curve.
+//
+struct _block_queue {
+    std::mutex mutex;     // queue lock
+    std::deque<int> ids;  // block indices
+};
+
+//
+// Pops a block from a queue. Returns -1 if empty.
+//
+static inline int _pop_block(_block_queue& queue, bool steal) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.ids.empty()) return -1;
+    auto bid = 0;
+    if (steal) {
+        bid = queue.ids.back();
+        queue.ids.pop_back();
+    } else {
+        bid = queue.ids.front();
+        queue.ids.pop_front();
+    }
+    return bid;
+}
+
+//
+// Number of threads to use when nthreads is requested (0 for hardware
+// concurrency).
+//
+static inline int _num_threads(int nthreads) {
+    if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+    if (nthreads <= 0) nthreads = 1;
+    return nthreads;
+}
+
+//
+// Calls block_fn(tid, xy, wh) for all image blocks using nthreads threads
+// with work stealing, where tid in [0, _num_threads(nthreads)) identifies
+// the calling thread so that it can use its own scratch state. Since no work
+// is added after start, a thread exits once all queues are empty.
+//
+template <typename Block_fn>
+static inline void _parallel_blocks(const vec2i& size, int nthreads,
+                                    int block_size, const Block_fn& block_fn) {
+    nthreads = _num_threads(nthreads);
+
+    // split the curve in contiguous runs, one per thread
+    auto blocks = _make_hilbert_blocks(size, block_size);
+    auto queues = vector<_block_queue>(nthreads);
+    for (auto bid = 0; bid < blocks.size(); bid++) {
+        queues[(int)(((int64_t)bid * nthreads) / blocks.size())].ids.push_back(
+            bid);
+    }
+
+    // worker loop
+    auto work = [&blocks, &queues, &block_fn, nthreads](int tid) {
+        while (true) {
+            auto bid = _pop_block(queues[tid], false);
+            for (auto v = 1; bid < 0 && v < nthreads; v++) {
+                bid = _pop_block(queues[(tid + v) % nthreads], true);
+            }
+            if (bid < 0) break;
+            block_fn(tid, blocks[bid].first, blocks[bid].second);
+        }
+    };
+
+    // run on nthreads-1 new threads and the calling one
+    auto threads = vector<std::thread>();
+    for (auto tid = 1; tid < nthreads; tid++) threads.emplace_back(work, tid);
+    work(0);
+    for (auto& thread : threads) thread.join();
+}
+
+//
+// Renders the image in parallel with static intersection. Public API, see
+// above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_image_parallel(const scene& scn, int cid,
+                                  image_view<vec4f> img, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads, int block_size,
+                                  bool accumulate) {
+    auto ctxs = vector<_render_context>(_num_threads(nthreads));
+    _parallel_blocks(img.size(), nthreads, block_size,
+                     [&](int tid, const vec2i& xy, const vec2i& wh) {
+                         _trace_strip_block(scn, cid, img, img.size(), 0, ns,
+                                            xy, wh, samples, params,
+                                            intersect_first, intersect_any,
+                                            ctxs[tid], accumulate);
+                     });
+}
+
+//
+// Renders a strip of rows of the image in parallel with static
+// intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_strip_parallel(const scene& scn, int cid, const vec2i& size,
+                                  int row, image_view<vec4f> strip, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads, int block_size) {
+    auto ctxs = vector<_render_context>(_num_threads(nthreads));
+    _parallel_blocks(strip.size(), nthreads, block_size,
+                     [&](int tid, const vec2i& xy, const vec2i& wh) {
+                         _trace_strip_block(scn, cid, strip, size, row, ns, xy,
+                                            wh, samples, params,
+                                            intersect_first, intersect_any,
+                                            ctxs[tid], false);
+                     });
+}
+
+//
+// Renders the preview cells in the block xy, wh of the cells of the window
+// wxy, wwh with a fixed shader.
+//
+template <shader_type stype, typename Intersector>
+static inline void _trace_preview_block(const scene& scn,
+                                        const Intersector& intersector,
+                                        int cid, image_view<vec4f> img, int ns,
+                                        int scale, const vec2i& wxy,
+                                        const vec2i& wwh, const vec2i& xy,
+                                        const vec2i& wh,
+                                        const render_params& params,
+                                        _render_context& ctx) {
+    auto& cam = scn.cameras[cid];
+    for (auto cj = xy[1]; cj < xy[1] + wh[1]; cj++) {
+        for (auto ci = xy[0]; ci < xy[0] + wh[0]; ci++) {
+            // pixels of the cell, clipped to the window
+            auto cmin = vec2i{wxy[0] + ci * scale, wxy[1] + cj * scale};
+            auto cmax = vec2i{min(cmin[0] + scale, wxy[0] + wwh[0]),
+                              min(cmin[1] + scale, wxy[1] + wwh[1])};
+            auto ij = vec2i{(cmin[0] + cmax[0]) / 2, (cmin[1] + cmax[1]) / 2};
+            auto l = _trace_sample<stype>(scn, intersector, cam, img.size(), ij,
+                                          0, ns, params, ctx);
+            for (auto j = cmin[1]; j < cmax[1]; j++) {
+                for (auto i = cmin[0]; i < cmax[0]; i++) img[{i, j}] = l;
+            }
+        }
+    }
+}
+
+//
+// Renders a preview with static intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_preview(const scene& scn, int cid, image_view<vec4f> img,
+                           int ns, int scale, const render_params& params,
+                           const Intersect_first& intersect_first,
+                           const Intersect_any& intersect_any, const vec2i& xy,
+                           const vec2i& wh, int nthreads, int block_size) {
+    auto wh_ = vec2i{(wh[0] < 0) ? img.size()[0] - xy[0] : wh[0],
+                     (wh[1] < 0) ? img.size()[1] - xy[1] : wh[1]};
+    scale = max(scale, 1);
+    auto ncells =
+        vec2i{(wh_[0] + scale - 1) / scale, (wh_[1] + scale - 1) / scale};
+    auto intersector = _intersector<Intersect_first, Intersect_any>{
+        intersect_first, intersect_any};
+    auto ctxs = vector<_render_context>(_num_threads(nthreads));
+    _parallel_blocks(
+        ncells, nthreads, block_size,
+        [&](int tid, const vec2i& cxy, const vec2i& cwh) {
+            switch (params.stype) {
+                case shader_type::eyelight:
+                    _trace_preview_block<shader_type::eyelight>(
+                        scn, intersector, cid, img, ns, scale, xy, wh_, cxy,
+                        cwh, params, ctxs[tid]);
+                    break;
+                case shader_type::def:
+                case shader_type::direct:
+                    _trace_preview_block<shader_type::direct>(
+                        scn, intersector, cid, img, ns, scale, xy, wh_, cxy,
+                        cwh, params, ctxs[tid]);
+                    break;
+                case shader_type::pathtrace:
+                    _trace_preview_block<shader_type::pathtrace>(
+                        scn, intersector, cid, img, ns, scale, xy, wh_, cxy,
+                        cwh, params, ctxs[tid]);
+                    break;
+                default: assert(false); return;
+            }
+        });
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Renders a preview. Public API, see above.
+//
+YGL_API void trace_preview(const scene& scn, int cid, image_view<vec4f> img,
+                           int ns, int scale, const render_params& params,
+                           const vec2i& xy, const vec2i& wh, int nthreads,
+                           int block_size) {
+    trace_preview(scn, cid, img, ns, scale, params, scn.intersect_first,
+                  scn.intersect_any, xy, wh, nthreads, block_size);
+}
+
+//
+// Preview schedule. Public API, see above.
+//
+YGL_API vector<int> make_preview_schedule(int max_scale) {
+    auto scale = 1;
+    while (scale * 2 <= max_scale) scale *= 2;
+    auto scales = vector<int>();
+    for (; scale >= 1; scale /= 2) scales.push_back(scale);
+    return scales;
+}
+#endif
+
+//
+// Renders the image in parallel into an accumulation buffer, guided by guide
+// if not null.
+//
+template <typename Intersect_first, typename Intersect_any>
+static inline void _trace_image_parallel(
+    const scene& scn, int cid, accum_buffer& buf, int ns, const vec2i& samples,
+    const render_params& params, const Intersect_first& intersect_first,
+    const Intersect_any& intersect_any, path_guide* guide, int nthreads,
+    int block_size) {
+    auto ctxs = vector<_render_context>(_num_threads(nthreads));
+    for (auto& ctx : ctxs)
+        ctx.guide = (guide && !guide->nodes.empty()) ? guide : nullptr;
+    _parallel_blocks(buf.sum.size(), nthreads, block_size,
+                     [&](int tid, const vec2i& xy, const vec2i& wh) {
+                         _trace_accum_block(scn, cid, buf, ns, xy, wh, samples,
+                                            params, intersect_first,
+                                            intersect_any, ctxs[tid]);
+                     });
+    buf.samples = (buf.samples[0] == buf.samples[1])
+                      ? samples
+                      : vec2i{buf.samples[0], samples[1]};
+    buf.ns = ns;
+    buf.rtype = params.rtype;
+    buf.stype = params.stype;
+}
+
+//
+// Renders the image in parallel into an accumulation buffer with static
+// intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API void trace_image_parallel(const scene& scn, int cid, accum_buffer& buf,
+                                  int ns, const vec2i& samples,
+                                  const render_params& params,
+                                  const Intersect_first& intersect_first,
+                                  const Intersect_any& intersect_any,
+                                  int nthreads, int block_size) {
+    _trace_image_parallel(scn, cid, buf, ns, samples, params, intersect_first,
+                          intersect_any, nullptr, nthreads, block_size);
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Renders a strip of rows of the image in parallel. Public API, see above.
+//
+YGL_API void trace_strip_parallel(const scene& scn, int cid, const vec2i& size,
+                                  int row, image_view<vec4f> strip, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params, int nthreads,
+                                  int block_size) {
+    trace_strip_parallel(scn, cid, size, row, strip, ns, samples, params,
+                         scn.intersect_first, scn.intersect_any, nthreads,
+                         block_size);
+}
+
+//
+// Renders the image in parallel into an accumulation buffer. Public API,
+// see above.
+//
+YGL_API void trace_image_parallel(const scene& scn, int cid, accum_buffer& buf,
+                                  int ns, const vec2i& samples,
+                                  const render_params& params, int nthreads,
+                                  int block_size) {
+    trace_image_parallel(scn, cid, buf, ns, samples, params,
+                         scn.intersect_first, scn.intersect_any, nthreads,
+                         block_size);
+}
+
+//
+// Renders the image in parallel. Public API, see above.
+//
+YGL_API void trace_image_parallel(const scene& scn, int cid,
+                                  image_view<vec4f> img, int ns,
+                                  const vec2i& samples,
+                                  const render_params& params, int nthreads,
+                                  int block_size, bool accumulate) {
+    trace_image_parallel(scn, cid, img, ns, samples, params,
+                         scn.intersect_first, scn.intersect_any, nthreads,
+                         block_size, accumulate);
+}
 #endif
 
+//
+// Mean over the pixels of the relative standard error of their luminance,
+// with the same clamping of the convergence test. Pixels with less than two
+// samples have infinite error.
+//
+static inline float _mean_relative_error(const accum_buffer& buf) {
+    auto size = buf.sum.size();
+    auto err = 0.0;
+    for (auto j = 0; j < size[1]; j++) {
+        for (auto i = 0; i < size[0]; i++) {
+            auto ij = vec2i{i, j};
+            auto n = buf.count[ij];
+            if (n < 2) return FLT_MAX;
+            auto& sum = buf.sum[ij];
+            auto mu = mean(vec3f{sum[0], sum[1], sum[2]}) / n;
+            auto var = max((buf.sum2[ij] / n - mu * mu) * n / (n - 1), 0.0f);
+            err += sqrt(var / n) / max(mu, 0.01f);
+        }
+    }
+    return (float)(err / ((double)size[0] * (double)size[1]));
+}
+
+//
+// Total number of samples in the buffer.
+//
+static inline double _total_samples(const accum_buffer& buf) {
+    auto total = 0.0;
+    for (auto c : image_view<int>(buf.count)) total += c;
+    return total;
+}
+
+//
+// Renders the image progressively, guided by guide if not null.
+//
+// Implementation Notes: when redistributing samples, the budget is the one
+// of rendering ns samples per pixel from the start of the buffer range, so
+// that resuming from a checkpoint does not grant a new budget.
+//
+template <typename Intersect_first, typename Intersect_any>
+static inline int _trace_image_progressive(
+    const scene& scn, int cid, accum_buffer& buf, int ns,
+    const render_params& params, const Intersect_first& intersect_first,
+    const Intersect_any& intersect_any, path_guide* guide, int nthreads,
+    int block_size) {
+    auto batch = max(params.batch_samples, 1);
+    auto redistribute = params.adaptive && params.adaptive_max_samples > ns;
+    auto nmax = (redistribute) ? params.adaptive_max_samples : ns;
+    auto size = buf.sum.size();
+    auto budget = (double)(ns - buf.samples[0]) * size[0] * size[1];
+    auto total = (redistribute) ? _total_samples(buf) : 0.0;
+    auto elapsed = 0.0, last = 0.0;
+    while (buf.samples[1] < nmax) {
+        if (params.time_budget > 0 && elapsed + last > params.time_budget)
+            break;
+        if (params.target_error > 0 && buf.samples[1] > 0 &&
+            _mean_relative_error(buf) <= params.target_error)
+            break;
+        if (redistribute && total >= budget) break;
+        auto s = buf.samples[1];
+        auto batch_timer = timer();
+        _trace_image_parallel(scn, cid, buf, nmax, {s, min(s + batch, nmax)},
+                              params, intersect_first, intersect_any, guide,
+                              nthreads, block_size);
+        if (guide) _update_guide(*guide, buf.samples[1] - s);
+        last = batch_timer.elapsed();
+        elapsed += last;
+        if (redistribute) {
+            auto last_total = total;
+            total = _total_samples(buf);
+            if (total == last_total) break;
+        }
+    }
+    return buf.samples[1];
+}
+
+//
+// Renders the image progressively with static intersection. Public API, see
+// above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    const Intersect_first& intersect_first,
+                                    const Intersect_any& intersect_any,
+                                    int nthreads, int block_size) {
+    return _trace_image_progressive(scn, cid, buf, ns, params, intersect_first,
+                                    intersect_any, nullptr, nthreads,
+                                    block_size);
+}
+
+//
+// Renders the image progressively with path guiding and static
+// intersection. Public API, see above.
+//
+template <typename Intersect_first, typename Intersect_any>
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    path_guide& guide,
+                                    const Intersect_first& intersect_first,
+                                    const Intersect_any& intersect_any,
+                                    int nthreads, int block_size) {
+    return _trace_image_progressive(scn, cid, buf, ns, params, intersect_first,
+                                    intersect_any, &guide, nthreads,
+                                    block_size);
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Renders the image progressively. Public API, see above.
+//
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params, int nthreads,
+                                    int block_size) {
+    return trace_image_progressive(scn, cid, buf, ns, params,
+                                   scn.intersect_first, scn.intersect_any,
+                                   nthreads, block_size);
+}
+
+//
+// Renders the image progressively with path guiding. Public API, see above.
+//
+YGL_API int trace_image_progressive(const scene& scn, int cid,
+                                    accum_buffer& buf, int ns,
+                                    const render_params& params,
+                                    path_guide& guide, int nthreads,
+                                    int block_size) {
+    return trace_image_progressive(scn, cid, buf, ns, params, guide,
+                                   scn.intersect_first, scn.intersect_any,
+                                   nthreads, block_size);
+}
+#endif
+
+//
+// Divides the color by the albedo, skipping channels with no albedo.
+//
+static inline vec3f _demodulate_albedo(const vec4f& c, const vec4f& a) {
+    auto d = vec3f{c[0], c[1], c[2]};
+    for (auto k = 0; k < 3; k++)
+        if (a[k] > 0.01f) d[k] /= a[k];
+    return d;
+}
+
+//
+// Multiplies the color by the albedo, skipping channels with no albedo.
+//
+static inline vec3f _modulate_albedo(const vec3f& c, const vec4f& a) {
+    auto m = c;
+    for (auto k = 0; k < 3; k++)
+        if (a[k] > 0.01f) m[k] *= a[k];
+    return m;
+}
+
+//
+// Runs one a-trous pass with the given step over a block of pixels.
+//
+// Implementation Notes: color differences are computed after mapping colors
+// to [0,1) with c / (1 + c), so that the color sigma does not depend on the
+// image exposure and fireflies do not stop the filter.
+//
+static inline void _denoise_block(const image<vec3f>& src, image<vec3f>& dst,
+                                  const image_view<vec4f>& albedo,
+                                  const image_view<vec4f>& normal,
+                                  const image_view<vec4f>& depth, int step,
+                                  float sigma_color,
+                                  const denoise_params& params,
+                                  const vec2i& xy, const vec2i& wh) {
+    static const float kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f,
+                                    1 / 16.0f};
+    auto size = src.size();
+    auto isc2 = 1 / (sigma_color * sigma_color);
+    auto isa2 = 1 / (params.sigma_albedo * params.sigma_albedo);
+    auto isn2 = 1 / (params.sigma_normal * params.sigma_normal);
+    auto sz = params.sigma_depth * step;
+    auto isz2 = 1 / (sz * sz);
+    for (auto j = xy[1]; j < xy[1] + wh[1]; j++) {
+        for (auto i = xy[0]; i < xy[0] + wh[0]; i++) {
+            auto ij = vec2i{i, j};
+            auto cp = src[ij];
+            auto tp = cp / (1.0f + cp);
+            auto ap = albedo[ij], np = normal[ij];
+            auto zp = depth[ij][0];
+            auto sum = zero3f;
+            auto wsum = 0.0f;
+            for (auto dj = -2; dj <= 2; dj++) {
+                auto qj = j + dj * step;
+                if (qj < 0 || qj >= size[1]) continue;
+                for (auto di = -2; di <= 2; di++) {
+                    auto qi = i + di * step;
+                    if (qi < 0 || qi >= size[0]) continue;
+                    auto qij = vec2i{qi, qj};
+                    auto cq = src[qij];
+                    auto tq = cq / (1.0f + cq);
+                    auto zq = depth[qij][0];
+                    auto dz = (zp == zq) ? 0.0f
+                                         : (zp - zq) / max(max(zp, zq), 1e-4f);
+                    auto e = distsqr(tp, tq) * isc2 +
+                             distsqr(ap, albedo[qij]) * isa2 +
+                             distsqr(np, normal[qij]) * isn2 +
+                             dz * dz * isz2;
+                    auto w = kernel[di + 2] * kernel[dj + 2] * exp(-e);
+                    sum += cq * w;
+                    wsum += w;
+                }
+            }
+            dst[ij] = sum / wsum;
+        }
+    }
+}
+
+#if (!defined(YGL_DECLARATION) || defined(YGL_IMPLEMENTATION))
+//
+// Denoises an image. Public API, see above.
+//
+// Implementation Notes: this is the filter of Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010,
+// with depth in place of positions. Each pass is a 5x5 B3-spline filter with
+// holes, whose step doubles at each pass.
+//
+YGL_API void denoise_image(image_view<vec4f> img,
+                           const image_view<vec4f>& albedo,
+                           const image_view<vec4f>& normal,
+                           const image_view<vec4f>& depth,
+                           const denoise_params& params, int nthreads) {
+    assert(img.size() == albedo.size() && img.size() == normal.size() &&
+           img.size() == depth.size());
+    auto size = img.size();
+    auto src = image<vec3f>(size), dst = image<vec3f>(size);
+    for (auto j = 0; j < size[1]; j++) {
+        for (auto i = 0; i < size[0]; i++) {
+            auto ij = vec2i{i, j};
+            src[ij] = _demodulate_albedo(img[ij], albedo[ij]);
+        }
+    }
+    auto sigma_color = params.sigma_color;
+    for (auto it = 0; it < params.iterations; it++) {
+        _parallel_blocks(size, nthreads, 32,
+                         [&](int, const vec2i& xy, const vec2i& wh) {
+                             _denoise_block(src, dst, albedo, normal, depth,
+                                            1 << it, sigma_color, params, xy,
+                                            wh);
+                         });
+        std::swap(src, dst);
+        sigma_color /= 2;
+    }
+    for (auto j = 0; j < size[1]; j++) {
+        for (auto i = 0; i < size[0]; i++) {
+            auto ij = vec2i{i, j};
+            auto c = _modulate_albedo(src[ij], albedo[ij]);
+            img[ij] = {c[0], c[1], c[2], img[ij][3]};
+        }
+    }
+}
+
+//
+// Denoises an image with the guides of an accumulation buffer. Public API,
+// see above.
+//
+YGL_API void denoise_image(image_view<vec4f> img, const accum_buffer& buf,
+                           const denoise_params& params, int nthreads) {
+    assert(!buf.ids.empty());
+    auto albedo = image<vec4f>(img.size());
+    auto normal = image<vec4f>(img.size());
+    auto depth = image<vec4f>(img.size());
+    resolve_aov(buf, aov_type::albedo, albedo);
+    resolve_aov(buf, aov_type::normal, normal);
+    resolve_aov(buf, aov_type::depth, depth);
+    denoise_image(img, albedo, normal, depth, params, nthreads);
+}
+#endif
+
+}  // namespace
+
 #endif